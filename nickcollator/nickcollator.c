@@ -31,25 +31,203 @@
 #include <unicode/ucnv.h>     // ICU for UTF-8 conversion
 #include <unicode/ustring.h>  // ICU for handling Unicode strings
 #include <unicode/unorm2.h>   // ICU for normalizing Unicode
+#include <sys/mman.h>         // mmap for the skeleton table
+#include <sys/stat.h>
+#if defined(__AVX2__)
+#include <immintrin.h>        // AVX2 for the ASCII pre-scan
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>        // SSSE3 for the ASCII pre-scan
+#elif defined(__SSE2__)
+#include <emmintrin.h>        // SSE2 for the ASCII pre-scan
+#endif
 
 #define MYCONF "nickcollator"
 
+#define NC_CANON_MAX 128          // Max UChars of a nick after conversion and mapping
+#define NC_KEY_MAX 512            // Max bytes of a canonical key (mapped UTF-16 or ICU sort key)
+#define NC_INDEX_SIZE 65536       // Buckets in the canonical nick index (power of two)
+#define NC_BLOOM_SIZE (1 << 20)   // Counters in the Bloom filter of an index table (power of two)
+#define NC_BLOOM_HASHES 3         // Counters set per key
+#define NC_REJECT_CACHE 4096      // Recently rejected nicks remembered per index (power of two)
+#define NC_FAST_MAX 64            // Longest nick in bytes considered for the ASCII fast path
+#define NC_REBUILD_BATCH 2000     // Users re-canonicalized per event loop tick after a rule change
+#define NC_HIST_BUCKETS 32        // Latency histogram buckets, bucket i counts [2^i, 2^(i+1)) ns
+#define NC_RENAME_PREFIX "Guest"  // Prefix of the nick given to the loser of a collision, followed by its UID
+
+// What to do when a remote or forced nick collates equal to an existing one
+enum nc_collision_policy {
+    NC_COLLISION_LOG,         // Only log it
+    NC_COLLISION_RENAME,      // Rename the newer of the two users
+    NC_COLLISION_REJECT,      // Disconnect the newer of the two users
+};
+
 // Structure to hold groups of equivalent characters
 struct mapping {
     char **equivalents;       // List of equivalent characters or strings
     int num_equivalents;      // How many equivalents are in this group
 };
 
+// Node of the compiled mapping trie. The children of a node are stored
+// contiguously and sorted by code unit, so a step is a binary search.
+struct trie_node {
+    UChar unit;               // Code unit leading to this node
+    int32_t first_child;      // Index of the first child in nodes[]
+    int32_t num_children;     // Number of children
+    int32_t out;              // Replacement (index into reps) if a pattern ends here, else -1
+};
+
+// All mapping groups compiled into one trie over UTF-16 code units. Every
+// equivalent maps to the canonical representative of its class, so a nick
+// is rewritten in a single left-to-right pass.
+struct mapping_trie {
+    struct trie_node *nodes;  // nodes[0] is the root
+    int32_t num_nodes;
+    UChar *pool;              // Replacement strings, back to back
+    int32_t *rep_offset;      // Offset of each replacement in pool
+    int32_t *rep_length;      // Length of each replacement
+    int32_t num_reps;
+    uint8_t ascii_lut[16];    // For each low nibble, bit n is set if ASCII char (n << 4 | nibble)
+                              // occurs in an all-ASCII equivalent and may thus be rewritten
+};
+
+#define NC_SKELETON_MAGIC "NCSKEL\0\0"
+#define NC_SKELETON_VERSION 1
+#define NC_SKELETON_BYTE_ORDER 0x01020304
+
+// Header of a precompiled UTS #39 skeleton table, as written by tools/nc_skelgen.
+// The file is mmap'ed as is, so it uses the byte order of the generating host.
+struct skeleton_header {
+    char magic[8];            // NC_SKELETON_MAGIC
+    uint32_t version;         // NC_SKELETON_VERSION
+    uint32_t byte_order;      // NC_SKELETON_BYTE_ORDER in the writer's byte order
+    uint32_t num_entries;     // Number of entries, sorted by code point
+    uint32_t entries_offset;  // File offset of the entries
+    uint32_t pool_units;      // Number of UTF-16 code units in the pool
+    uint32_t pool_offset;     // File offset of the replacement pool
+};
+
+// One confusable: code point -> prototype (UTF-16, in the pool)
+struct skeleton_entry {
+    uint32_t codepoint;
+    uint32_t offset;          // Offset of the replacement in the pool, in code units
+    uint32_t length;          // Length of the replacement in code units
+};
+
+// A loaded (mmap'ed) skeleton table
+struct skeleton_table {
+    void *map;                // Start of the mapping, NULL if no table is loaded
+    size_t size;              // Size of the mapping
+    const struct skeleton_entry *entries;
+    uint32_t num_entries;
+    const UChar *pool;
+    uint64_t fingerprint;     // Hash of the file contents
+};
+
+// A protected nick from the config
+struct protected_nick {
+    char *nick;
+    char *account;            // Account allowed to use it, or NULL
+};
+
+// A protected nick in the hash set of a rule set, by canonical key
+struct protected_entry {
+    uint64_t hashv;           // Hash of key, 0 marks an empty slot
+    int keylen;
+    uint8_t *key;             // Canonical key under the rule set
+    char *nick;               // Nick as configured
+    char *account;            // Account allowed to use it, or NULL
+};
+
+// A compiled rule set: the mapping trie, the skeleton table and the collator.
+// It is built completely before use and never modified afterwards, so a REHASH
+// can prepare a new one while the current one keeps serving NICK checks.
+struct ruleset {
+    int collator_strength;    // Strength the collator was opened with, -1 = off
+    UCollator *collator;      // ICU collator, NULL if collation is off
+    struct mapping_trie trie; // All mapping groups compiled into one trie
+    struct skeleton_table skeleton; // Skeleton table, if one is configured
+    int protect_channels;     // Whether channel names are indexed and checked on JOIN
+    struct protected_entry *protected; // Open addressing hash set of protected nicks
+    uint32_t protected_size;  // Slots in protected (power of two), 0 if there are none
+    char protected_siphashkey[SIPHASH_KEY_LENGTH];
+    uint64_t fingerprint;     // Rule sets with equal fingerprints canonicalize equally
+};
+
 // Structure for holding all mappings, related information and configuration options
 struct cfgstruct {
     struct mapping *mappings; // Array of all mappings
     int num_mappings;         // Number of groups in mappings
+    char *skeleton_file;      // Path of the precompiled skeleton table, if any
     unsigned short int got_mapping; // Indicates if mappings are defined in config
     int collator_strength;  // Hold collator strength option
+    int collision_policy;     // enum nc_collision_policy
+    int protect_channels;     // Block new channels that collate equal to an existing one
+    struct protected_nick *protected; // Nicks reserved by the protected block
+    int num_protected;
 };
 
 static struct cfgstruct muhcfg; // Global configuration structure
 
+struct nick_index;
+struct nick_cache;
+
+// Tables of a canonical index
+enum nc_table {
+    NC_TABLE_NICKS,           // Users, by nick
+    NC_TABLE_CHANNELS,        // Channels, by name (only with protect-channels)
+    NC_NUM_TABLES
+};
+
+// Canonical form of a client's nick or a channel's name under the rule set of
+// one index, linked into that index. It stays valid until the name changes or
+// the index is freed.
+struct nick_entry {
+    struct nick_entry *next;  // Next entry in the same index bucket
+    struct nick_index *index; // Index the entry is linked into
+    int table;                // enum nc_table
+    struct nick_cache *cache; // Per-client or per-channel cache holding the entry
+    void *owner;              // Client or Channel owning this name
+    uint64_t hashv;           // Full hash of the key
+    int32_t canon_len;        // Length of canon in UChars
+    int keylen;               // Length of key in bytes
+    UChar *canon;             // Mapped UTF-16 nick (points into data)
+    uint8_t *key;             // Canonical key: ICU sort key, or canon as bytes (points into data)
+    uint8_t data[];
+};
+
+// A recently rejected nick: hash of the nick as sent, and hash of the
+// canonical key it collided with
+struct reject_entry {
+    uint64_t nickhash;
+    uint64_t keyhash;
+};
+
+// Canonical nick index: all users (and channels), hashed by the canonical key
+// of their name under one rule set. While new rules are being applied two
+// indexes exist.
+struct nick_index {
+    struct nick_entry **buckets[NC_NUM_TABLES];
+    int count[NC_NUM_TABLES]; // Number of entries linked
+    uint8_t *bloom[NC_NUM_TABLES]; // Counting Bloom filter over the keys of a table, NULL if unused
+    struct reject_entry *rejects; // Recently rejected nicks, direct mapped
+    char siphashkey[SIPHASH_KEY_LENGTH];
+    struct ruleset *rules;    // Rule set the keys were computed with, owned by the index
+    int slot;                 // Slot of struct nick_cache holding this index's entries
+};
+
+// Per-client and per-channel ModData: the entry in each of the (at most two) indexes
+struct nick_cache {
+    struct nick_entry *entry[2];
+};
+
+static ModDataInfo *nick_cache_md = NULL;     // Per-client struct nick_cache
+static ModDataInfo *chan_cache_md = NULL;     // Per-channel struct nick_cache
+
+#define NICK_CACHE(client) ((struct nick_cache *)moddata_client(client, nick_cache_md).ptr)
+
+// NICKCOLLATOR_STANDALONE builds only the mapping, collation and index core,
+// without the IRCd glue, for the benchmark in tools/
+#ifndef NICKCOLLATOR_STANDALONE
 // Module header - contains basic info about the module
 ModuleHeader MOD_HEADER = {
     "third/nickcollator",      // Module name
@@ -59,149 +237,1638 @@ ModuleHeader MOD_HEADER = {
     "unrealircd-6",            // Compatible UnrealIRCd version
 };
 
-// Function prototypes (declarations of functions defined later)
-void setcfg(void);
-void freecfg(void);
+// Function prototypes for the IRCd glue
 int MODNAME_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs);
 int MODNAME_configrun(ConfigFile *cf, ConfigEntry *ce, int type);
-void apply_collator_mapping(UChar *u_str, int32_t length);
-int compare_nicks(const char *nick1, const char *nick2);
 CMD_OVERRIDE_FUNC(override_nick);
+CMD_OVERRIDE_FUNC(override_join);
+int nickcollator_channel_create(Channel *channel);
+int nickcollator_connect(Client *client);
+int nickcollator_quit(Client *client, MessageTag *mtags, const char *comment);
+int nickcollator_pre_nickchange(Client *client, MessageTag *mtags, const char *newnick);
+int nickcollator_post_nickchange(Client *client, MessageTag *mtags, const char *oldnick);
+int nickcollator_stats(Client *client, const char *flag);
+void nc_state_free(ModData *m);
+EVENT(nickcollator_collisions);
+
+// The indexes survive a REHASH, so the old rules can keep serving while the
+// index for the new ones is built across several event loop ticks
+struct nc_state {
+    struct nick_index *active;  // Index serving NICK checks
+    struct nick_index *pending; // Index being built for new rules, or NULL
+    char (*rebuild_ids)[IDLEN + 1]; // Users that were online when the rebuild started
+    int rebuild_count;
+    int rebuild_pos;            // Next user in rebuild_ids to add to pending
+    char **rebuild_channels;    // Channels that existed when the rebuild started
+    int rebuild_channel_count;
+    int rebuild_channel_pos;
+    // Local users that lost a collision, acted on by nickcollator_collisions.
+    // Kept here so that a REHASH between the check and the event loses none.
+    char (*collision_queue)[IDLEN + 1];
+    int collision_queue_len;
+    int collision_queue_size;
+};
+
+static struct nc_state *nc_state = NULL;
+static Event *rebuild_event = NULL;
+
+static unsigned long long nc_collisions = 0;
+static unsigned long long nc_collisions_renamed = 0;
+static unsigned long long nc_collisions_rejected = 0;
+static unsigned long long nc_protected_refused = 0;
+static unsigned long long nc_nick_checks = 0;    // NICK commands checked
+static unsigned long long nc_nick_rejected = 0;  // ... of which refused (in use, protected or not checkable)
+static unsigned long long nc_nick_uncheckable = 0; // ... of which refused as they cannot be canonicalized
+static unsigned long long nc_protected_renamed = 0;
+#endif
+
+// Function prototypes (declarations of functions defined later)
+void setcfg(void);
+void freecfg(void);
+int mapping_add_group(const char *str);
+void protected_add(const char *nick, const char *account);
+int mapping_compile(struct mapping_trie *trie);
+int skeleton_load(struct skeleton_table *table, const char *path, char **errstr);
+void skeleton_unload(struct skeleton_table *table);
+struct ruleset *ruleset_compile(void);
+void ruleset_free(struct ruleset *rs);
+int32_t apply_collator_mapping(const struct ruleset *rs, const UChar *in, int32_t length, UChar *out, int32_t outsize);
+int compare_nicks(const struct ruleset *rs, const char *nick1, const char *nick2);
+int nick_canonicalize(const struct ruleset *rs, const char *nick, UChar *canon, int32_t *canon_len, uint8_t *key, int keysize);
+int nick_canonical_key(const struct ruleset *rs, const char *nick, uint8_t *key, int keysize);
+void nick_cache_md_free(ModData *md);
+
+// How nicks were canonicalized: fully without ICU, without conversion and mapping
+// but still collated, or through the full ICU path
+static unsigned long long nc_fast_hits = 0;
+static unsigned long long nc_fast_collated = 0;
+static unsigned long long nc_icu_path = 0;
+
+// Nick checks answered by the reject cache or by the Bloom filter alone, and
+// Bloom filter hits that turned out not to be in the index
+static unsigned long long nc_reject_hits = 0;
+static unsigned long long nc_reject_misses = 0;
+static unsigned long long nc_bloom_negatives = 0;
+static unsigned long long nc_bloom_false_positives = 0;
+
+// Latency of the stages of a nick check, as log2 histograms. Build with
+// -DNICKCOLLATOR_NO_TIMING to compile the clock reads out completely.
+enum nc_stage {
+    NC_STAGE_CONVERT,         // UTF-8 to UTF-16 (or widening on the ASCII fast path)
+    NC_STAGE_MAPPING,         // Mappings and skeleton table, with NFD
+    NC_STAGE_COLLATE,         // ICU sort key, or copying the mapped nick
+    NC_STAGE_LOOKUP,          // Reject cache, index and protected nicks
+    NC_STAGE_TOTAL,           // The whole check in the NICK override
+    NC_NUM_STAGES
+};
+
+#ifndef NICKCOLLATOR_NO_TIMING
+static const char *nc_stage_names[NC_NUM_STAGES] = { "convert", "mapping", "collate", "lookup", "total" };
+
+struct nc_hist {
+    unsigned long long count;
+    unsigned long long sum_ns;
+    unsigned long long buckets[NC_HIST_BUCKETS];
+};
+
+static struct nc_hist nc_hist[NC_NUM_STAGES];
+
+static inline uint64_t nc_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void nc_hist_add(int stage, uint64_t ns) {
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    nc_hist[stage].count++;
+    nc_hist[stage].sum_ns += ns;
+    nc_hist[stage].buckets[b < NC_HIST_BUCKETS ? b : NC_HIST_BUCKETS - 1]++;
+}
+
+#define NC_TIME_START(t) uint64_t t = nc_now()
+#define NC_TIME_RESET(t) ((t) = nc_now())
+#define NC_TIME_END(stage, t) nc_hist_add(stage, nc_now() - (t))
+#define NC_TIME_LAP(stage, t) do { uint64_t lap_ = nc_now(); nc_hist_add(stage, lap_ - (t)); (t) = lap_; } while (0)
+
+// Upper bound in ns of the given percentile of a histogram, 0 if it is empty
+static unsigned long long nc_hist_percentile(const struct nc_hist *h, double pct) {
+    unsigned long long seen = 0, want = (unsigned long long)(h->count * pct / 100.0);
+    int b;
+
+    if (!h->count) {
+        return 0;
+    }
+    for (b = 0; b < NC_HIST_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen > want) {
+            break;
+        }
+    }
+    return 2ULL << b;
+}
+#else
+#define NC_TIME_START(t)
+#define NC_TIME_RESET(t)
+#define NC_TIME_END(stage, t)
+#define NC_TIME_LAP(stage, t)
+#endif /* NICKCOLLATOR_NO_TIMING */
+
+// Function to initialize the configuration with default values
+void setcfg(void) {
+    muhcfg.mappings = NULL;       // Set mappings to NULL (empty at start)
+    muhcfg.num_mappings = 0;      // Set number of mappings to zero
+    muhcfg.got_mapping = 0;       // Indicate that no mappings are yet defined
+    muhcfg.collator_strength = -1;     // Default to "off" for collator strength
+    muhcfg.collision_policy = NC_COLLISION_LOG; // Renaming or disconnecting users is opt-in
+}
+
+// Function to free memory used by configuration
+void freecfg(void) {
+    int i, j;
+    // Free each equivalent string within each mapping
+    for (i = 0; i < muhcfg.num_mappings; i++) {
+        for (j = 0; j < muhcfg.mappings[i].num_equivalents; j++) {
+            safe_free(muhcfg.mappings[i].equivalents[j]);
+        }
+        safe_free(muhcfg.mappings[i].equivalents); // Free the equivalents array
+    }
+    safe_free(muhcfg.mappings); // Free the mappings array itself
+    for (i = 0; i < muhcfg.num_protected; i++) {
+        safe_free(muhcfg.protected[i].nick);
+        safe_free(muhcfg.protected[i].account);
+    }
+    safe_free(muhcfg.protected);
+    muhcfg.num_protected = 0;
+    safe_free(muhcfg.skeleton_file);
+}
+
+// Free a compiled trie
+static void trie_free(struct mapping_trie *trie) {
+    safe_free(trie->nodes);
+    safe_free(trie->pool);
+    safe_free(trie->rep_offset);
+    safe_free(trie->rep_length);
+    memset(trie, 0, sizeof(*trie));
+}
+
+// Open an ICU collator (for comparing strings) with the given strength
+static UCollator *collator_open(int strength) {
+    UErrorCode status = U_ZERO_ERROR;
+    UCollator *coll;
+
+    coll = ucol_open("", &status);      // Open a default collator
+    if (U_FAILURE(status)) {            // Check if it failed
+        config_error("ICU collator could not be initialized: %s", u_errorName(status));
+        return NULL;
+    }
+    ucol_setStrength(coll, strength);   // Set collation strength
+    return coll;
+}
+
+// A single equivalent while compiling the trie
+struct pattern {
+    UChar str[NC_CANON_MAX];  // Equivalent in UTF-16
+    int32_t len;
+    int group;                // Mapping group it came from
+};
+
+static int pattern_cmp(const void *a, const void *b) {
+    const struct pattern *pa = a, *pb = b;
+    int32_t n = pa->len < pb->len ? pa->len : pb->len;
+    int r = u_memcmp(pa->str, pb->str, n);
+    if (r) {
+        return r;
+    }
+    if (pa->len != pb->len) {
+        return pa->len < pb->len ? -1 : 1;
+    }
+    return pa->group - pb->group;
+}
+
+// Union-find over mapping groups, so groups sharing an equivalent form one class
+static int group_find(int *parent, int g) {
+    while (parent[g] != g) {
+        parent[g] = parent[parent[g]];
+        g = parent[g];
+    }
+    return g;
+}
+
+// Build the children of 'node' from the sorted patterns [lo, hi), which all
+// share their first 'depth' code units
+static void trie_build(struct mapping_trie *trie, struct pattern *pat, int *rep_of,
+                       int32_t node, int lo, int hi, int depth) {
+    int i, j, n;
+    int32_t child;
+
+    // Patterns ending here; duplicates all map to the same representative
+    while (lo < hi && pat[lo].len == depth) {
+        trie->nodes[node].out = rep_of[pat[lo].group];
+        lo++;
+    }
+    if (lo >= hi) {
+        return;
+    }
+
+    // Count distinct next code units and reserve the children in one block
+    for (n = 0, i = lo; i < hi; i = j, n++) {
+        for (j = i + 1; j < hi && pat[j].str[depth] == pat[i].str[depth]; j++);
+    }
+    child = trie->num_nodes;
+    trie->num_nodes += n;
+    trie->nodes[node].first_child = child;
+    trie->nodes[node].num_children = n;
+
+    for (i = lo; i < hi; i = j, child++) {
+        for (j = i + 1; j < hi && pat[j].str[depth] == pat[i].str[depth]; j++);
+        trie->nodes[child].unit = pat[i].str[depth];
+        trie->nodes[child].out = -1;
+        trie_build(trie, pat, rep_of, child, i, j, depth + 1);
+    }
+}
+
+// Add one protected nick, optionally owned by an account, to the configuration
+void protected_add(const char *nick, const char *account) {
+    muhcfg.protected = realloc(muhcfg.protected, sizeof(struct protected_nick) * (muhcfg.num_protected + 1));
+    if (!muhcfg.protected) {
+        config_error("Memory allocation error");
+        muhcfg.num_protected = 0;
+        return;
+    }
+    muhcfg.protected[muhcfg.num_protected].nick = strdup(nick);
+    muhcfg.protected[muhcfg.num_protected].account = account ? strdup(account) : NULL;
+    muhcfg.num_protected++;
+}
+
+// Add one mapping group (e.g. "A, B, C") to the configuration
+int mapping_add_group(const char *str) {
+    char *token;
+
+    // Allocate memory for new mapping group
+    muhcfg.num_mappings++;
+    muhcfg.mappings = realloc(muhcfg.mappings, sizeof(struct mapping) * muhcfg.num_mappings);
+    if (!muhcfg.mappings) {
+        config_error("Memory allocation error");
+        return 0; // Error if memory allocation fails
+    }
+
+    struct mapping *current_mapping = &muhcfg.mappings[muhcfg.num_mappings - 1];
+    current_mapping->num_equivalents = 0;
+    current_mapping->equivalents = NULL;
+
+    // Tokenize mapping values (e.g., "A, B")
+    char *mapping_str = strdup(str);
+    token = strtok(mapping_str, ", ");
+    while (token) {
+        current_mapping->num_equivalents++;
+        current_mapping->equivalents = realloc(current_mapping->equivalents, sizeof(char *) * current_mapping->num_equivalents);
+        if (!current_mapping->equivalents) {
+            config_error("Memory allocation error");
+            safe_free(mapping_str);
+            return 0;
+        }
+        current_mapping->equivalents[current_mapping->num_equivalents - 1] = strdup(token);
+        token = strtok(NULL, ", ");
+    }
+    safe_free(mapping_str); // Free temporary string
+    return 1;
+}
+
+// Compile all mapping groups into an empty trie. Each class of equivalent strings
+// maps to the first equivalent of its earliest group, independent of rule order.
+int mapping_compile(struct mapping_trie *trie) {
+    struct pattern *pat = NULL;
+    int *parent = NULL, *rep_of = NULL;
+    int num_pat = 0, total_units = 0, pool_len = 0, i, j;
+
+    for (i = 0; i < muhcfg.num_mappings; i++) {
+        num_pat += muhcfg.mappings[i].num_equivalents;
+        for (j = 0; j < muhcfg.mappings[i].num_equivalents; j++) {
+            total_units += strlen(muhcfg.mappings[i].equivalents[j]); // UTF-16 is never longer
+        }
+    }
+    if (num_pat == 0) {
+        return 1;
+    }
+
+    pat = safe_alloc(sizeof(struct pattern) * num_pat);
+    parent = safe_alloc(sizeof(int) * muhcfg.num_mappings);
+    rep_of = safe_alloc(sizeof(int) * muhcfg.num_mappings);
+    trie->num_reps = muhcfg.num_mappings;
+    trie->rep_offset = safe_alloc(sizeof(int32_t) * trie->num_reps);
+    trie->rep_length = safe_alloc(sizeof(int32_t) * trie->num_reps);
+    trie->pool = safe_alloc(sizeof(UChar) * (total_units + 1));
+
+    // Convert every equivalent to UTF-16 once, keeping the first valid one of
+    // each group in the pool as that group's representative
+    num_pat = 0;
+    total_units = 0;
+    for (i = 0; i < muhcfg.num_mappings; i++) {
+        int got_rep = 0;
+
+        parent[i] = i;
+        for (j = 0; j < muhcfg.mappings[i].num_equivalents; j++) {
+            UErrorCode status = U_ZERO_ERROR;
+            struct pattern *p = &pat[num_pat];
+
+            u_strFromUTF8(p->str, NC_CANON_MAX, &p->len, muhcfg.mappings[i].equivalents[j], -1, &status);
+            if (U_FAILURE(status) || status == U_STRING_NOT_TERMINATED_WARNING || p->len == 0) {
+                config_warn("[nickcollator] Ignoring mapping entry '%s': not valid UTF-8 or too long",
+                            muhcfg.mappings[i].equivalents[j]);
+                continue;
+            }
+            p->group = i;
+            num_pat++;
+            total_units += p->len;
+
+            if (!got_rep) {
+                trie->rep_offset[i] = pool_len;
+                trie->rep_length[i] = p->len;
+                u_memcpy(trie->pool + pool_len, p->str, p->len);
+                pool_len += p->len;
+                got_rep = 1;
+            }
+        }
+    }
+
+    // Sorting puts identical equivalents next to each other, merge their groups
+    qsort(pat, num_pat, sizeof(struct pattern), pattern_cmp);
+    for (i = 1; i < num_pat; i++) {
+        if (pat[i].len == pat[i - 1].len && !u_memcmp(pat[i].str, pat[i - 1].str, pat[i].len)) {
+            int a = group_find(parent, pat[i].group);
+            int b = group_find(parent, pat[i - 1].group);
+            if (a < b) parent[b] = a; else parent[a] = b;
+        }
+    }
+
+    // A class is represented by its lowest group, which is also the root of the
+    // union-find since we always link to the lower one
+    for (i = 0; i < muhcfg.num_mappings; i++) {
+        rep_of[i] = group_find(parent, i);
+    }
+
+    // Every pattern code unit adds at most one node, plus the root
+    trie->nodes = safe_alloc(sizeof(struct trie_node) * (total_units + 1));
+    trie->num_nodes = 1;
+    trie->nodes[0].out = -1;
+    trie_build(trie, pat, rep_of, 0, 0, num_pat, 0);
+
+    // Only all-ASCII equivalents can match inside an all-ASCII nick
+    for (i = 0; i < num_pat; i++) {
+        for (j = 0; j < pat[i].len && pat[i].str[j] < 0x80; j++);
+        if (j < pat[i].len) {
+            continue;
+        }
+        for (j = 0; j < pat[i].len; j++) {
+            trie->ascii_lut[pat[i].str[j] & 0x0f] |= 1 << (pat[i].str[j] >> 4);
+        }
+    }
+
+    safe_free(pat);
+    safe_free(parent);
+    safe_free(rep_of);
+    return 1;
+}
+
+// Map a precompiled skeleton table and validate it. Only the header and the
+// entry order are checked, nothing is parsed, so this is cheap even for the
+// full confusables.txt. Returns 1 on success, 0 with *errstr set on failure.
+int skeleton_load(struct skeleton_table *table, const char *path, char **errstr) {
+    const struct skeleton_header *hdr;
+    struct stat st;
+    void *map;
+    uint32_t i;
+    int fd;
+
+    memset(table, 0, sizeof(*table));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *errstr = strerror(errno);
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct skeleton_header)) {
+        *errstr = "file too small";
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        *errstr = strerror(errno);
+        return 0;
+    }
+
+    hdr = map;
+    *errstr = NULL;
+    if (memcmp(hdr->magic, NC_SKELETON_MAGIC, sizeof(hdr->magic))) {
+        *errstr = "not a skeleton table";
+    } else if (hdr->version != NC_SKELETON_VERSION) {
+        *errstr = "unsupported version, regenerate it with nc_skelgen";
+    } else if (hdr->byte_order != NC_SKELETON_BYTE_ORDER) {
+        *errstr = "generated on a host with another byte order, regenerate it with nc_skelgen";
+    } else if (hdr->entries_offset % sizeof(uint32_t) || hdr->pool_offset % sizeof(UChar) ||
+               hdr->entries_offset + (uint64_t)hdr->num_entries * sizeof(struct skeleton_entry) > (uint64_t)st.st_size ||
+               hdr->pool_offset + (uint64_t)hdr->pool_units * sizeof(UChar) > (uint64_t)st.st_size) {
+        *errstr = "truncated or corrupt";
+    }
+    if (!*errstr) {
+        table->entries = (const struct skeleton_entry *)((const char *)map + hdr->entries_offset);
+        table->pool = (const UChar *)((const char *)map + hdr->pool_offset);
+        for (i = 0; i < hdr->num_entries && !*errstr; i++) {
+            if ((i > 0 && table->entries[i].codepoint <= table->entries[i - 1].codepoint) ||
+                (uint64_t)table->entries[i].offset + table->entries[i].length > hdr->pool_units ||
+                table->entries[i].length >= NC_CANON_MAX) {
+                *errstr = "entries out of order or out of range";
+            }
+        }
+    }
+    if (*errstr) {
+        munmap(map, st.st_size);
+        memset(table, 0, sizeof(*table));
+        return 0;
+    }
+
+    table->map = map;
+    table->size = st.st_size;
+    table->num_entries = hdr->num_entries;
+    table->fingerprint = siphash_raw(map, st.st_size, "nickcollator-sk");
+    return 1;
+}
+
+void skeleton_unload(struct skeleton_table *table) {
+    if (table->map) {
+        munmap(table->map, table->size);
+    }
+    memset(table, 0, sizeof(*table));
+}
+
+// Find the skeleton entry of a code point, or NULL if it is its own prototype
+static inline const struct skeleton_entry *skeleton_lookup(const struct skeleton_table *table, UChar32 cp) {
+    uint32_t lo = 0, hi = table->num_entries;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (table->entries[mid].codepoint == (uint32_t)cp) {
+            return &table->entries[mid];
+        }
+        if (table->entries[mid].codepoint < (uint32_t)cp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+// Let the ASCII fast path know which ASCII characters the skeleton table rewrites
+static void skeleton_mark_ascii(const struct skeleton_table *table, uint8_t *lut) {
+    uint32_t i;
+
+    for (i = 0; i < table->num_entries && table->entries[i].codepoint < 0x80; i++) {
+        lut[table->entries[i].codepoint & 0x0f] |= 1 << (table->entries[i].codepoint >> 4);
+    }
+}
+
+// NFD-normalize buf in place, as required around the UTS #39 skeleton mapping.
+// Returns the new length, or -1 if it does not fit into size UChars.
+static int32_t nfd_normalize(UChar *buf, int32_t len, int32_t size) {
+    UErrorCode status = U_ZERO_ERROR;
+    const UNormalizer2 *nfd = unorm2_getNFDInstance(&status);
+    UChar tmp[NC_CANON_MAX];
+
+    if (U_FAILURE(status)) {
+        return -1;
+    }
+    if (unorm2_isNormalized(nfd, buf, len, &status) && U_SUCCESS(status)) {
+        return len;
+    }
+    status = U_ZERO_ERROR;
+    len = unorm2_normalize(nfd, buf, len, tmp, NC_CANON_MAX, &status);
+    if (U_FAILURE(status) || len >= size || len >= NC_CANON_MAX) {
+        return -1;
+    }
+    u_memcpy(buf, tmp, len);
+    buf[len] = 0;
+    return len;
+}
+
+// Find the child of 'node' reached by code unit 'c', or -1
+static inline int32_t trie_step(const struct mapping_trie *trie, int32_t node, UChar c) {
+    int32_t lo = trie->nodes[node].first_child;
+    int32_t hi = lo + trie->nodes[node].num_children;
+
+    while (lo < hi) {
+        int32_t mid = (lo + hi) / 2;
+        if (trie->nodes[mid].unit == c) {
+            return mid;
+        }
+        if (trie->nodes[mid].unit < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+// Rewrite a Unicode string in one left-to-right pass, replacing the longest
+// matching equivalent at each position by its representative. Where no mapping
+// matches, a loaded skeleton table replaces the code point by its prototype,
+// so the mapping block acts as an override on top of the skeleton table.
+// Returns the output length, or -1 if it does not fit into outsize UChars.
+int32_t apply_collator_mapping(const struct ruleset *rs, const UChar *in, int32_t length, UChar *out, int32_t outsize) {
+    const struct mapping_trie *trie = &rs->trie;
+    const struct skeleton_table *skel = &rs->skeleton;
+    int32_t i = 0, o = 0;
+
+    while (i < length) {
+        int32_t node = 0, match = -1, match_len = 0, j;
+
+        if (trie->nodes) {
+            for (j = i; j < length && (node = trie_step(trie, node, in[j])) >= 0; j++) {
+                if (trie->nodes[node].out >= 0) {
+                    match = trie->nodes[node].out;
+                    match_len = j - i + 1;
+                }
+            }
+        }
+
+        if (match >= 0) {
+            if (o + trie->rep_length[match] >= outsize) {
+                return -1;
+            }
+            u_memcpy(out + o, trie->pool + trie->rep_offset[match], trie->rep_length[match]);
+            o += trie->rep_length[match];
+            i += match_len;
+        } else if (skel->map) {
+            const struct skeleton_entry *se;
+            int32_t cplen = 1;
+            UChar32 cp = in[i];
+
+            if (U16_IS_LEAD(in[i]) && i + 1 < length && U16_IS_TRAIL(in[i + 1])) {
+                cp = U16_GET_SUPPLEMENTARY(in[i], in[i + 1]);
+                cplen = 2;
+            }
+            se = skeleton_lookup(skel, cp);
+            if (se) {
+                if (o + (int32_t)se->length >= outsize) {
+                    return -1;
+                }
+                u_memcpy(out + o, skel->pool + se->offset, se->length);
+                o += se->length;
+            } else {
+                if (o + cplen >= outsize) {
+                    return -1;
+                }
+                u_memcpy(out + o, in + i, cplen);
+                o += cplen;
+            }
+            i += cplen;
+        } else {
+            if (o + 1 >= outsize) {
+                return -1;
+            }
+            out[o++] = in[i++];
+        }
+    }
+    out[o] = 0;
+    return o;
+}
+
+
+// Function to compare two nicknames after applying mappings
+int compare_nicks(const struct ruleset *rs, const char *nick1, const char *nick2) {
+    uint8_t key1[NC_KEY_MAX];
+    uint8_t key2[NC_KEY_MAX];
+    int len1, len2;
+
+    len1 = nick_canonical_key(rs, nick1, key1, sizeof(key1));
+    len2 = nick_canonical_key(rs, nick2, key2, sizeof(key2));
+
+    if (len1 < 0 || len2 < 0) {
+        return 0; // Return 0 if conversion fails
+    }
+
+    // Equal canonical keys mean the nicks collate equal
+    return (len1 == len2 && !memcmp(key1, key2, len1)) ? 0 : 1;
+}
+
+// Bit selected by the high nibble of a byte; 0 for bytes >= 0x80, which are
+// caught separately by the sign bit check
+static const uint8_t ascii_hi_bit[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+// Pre-scan a nick of 'len' bytes: returns 1 if it is pure ASCII and contains
+// no character that any mapping could rewrite, so it is its own canonical form.
+static int nick_fast_eligible(const struct ruleset *rs, const char *nick, size_t len) {
+    const uint8_t *lut = rs->trie.ascii_lut;
+    uint8_t buf[NC_FAST_MAX] __attribute__((aligned(32)));
+    size_t i;
+
+    if (len >= NC_FAST_MAX) {
+        return 0;
+    }
+    // Copy into a zero padded buffer so the vector loads never cross the string.
+    // NUL never occurs in an equivalent, so the padding cannot match.
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, nick, len);
+
+#if defined(__AVX2__)
+    __m256i lo_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lut));
+    __m256i hi_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ascii_hi_bit));
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    for (i = 0; i < len; i += 32) {
+        __m256i v = _mm256_load_si256((const __m256i *)(buf + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_lut, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        if (_mm256_movemask_epi8(v) ||
+            !_mm256_testz_si256(lo, hi)) {
+            return 0;
+        }
+    }
+    return 1;
+#elif defined(__SSSE3__)
+    __m128i lo_lut = _mm_loadu_si128((const __m128i *)lut);
+    __m128i hi_lut = _mm_loadu_si128((const __m128i *)ascii_hi_bit);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    for (i = 0; i < len; i += 16) {
+        __m128i v = _mm_load_si128((const __m128i *)(buf + i));
+        __m128i lo = _mm_shuffle_epi8(lo_lut, _mm_and_si128(v, nibble));
+        __m128i hi = _mm_shuffle_epi8(hi_lut, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        if (_mm_movemask_epi8(v) ||
+            _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff) {
+            return 0;
+        }
+    }
+    return 1;
+#else
+#if defined(__SSE2__)
+    // SSE2 has no byte shuffle: vectorize the ASCII check, test the mapped set per byte
+    for (i = 0; i < len; i += 16) {
+        if (_mm_movemask_epi8(_mm_load_si128((const __m128i *)(buf + i)))) {
+            return 0;
+        }
+    }
+#endif
+    for (i = 0; i < len; i++) {
+        if ((buf[i] & 0x80) || (lut[buf[i] & 0x0f] & ascii_hi_bit[buf[i] >> 4])) {
+            return 0;
+        }
+    }
+    return 1;
+#endif
+}
+
+// Compute the canonical form of a nick: the mapped UTF-16 string, and its key,
+// which is the ICU sort key when a collator is in use and the mapped string
+// otherwise. Two nicks collide if their keys are equal.
+// Returns the key length in bytes, or -1 if the nick cannot be converted.
+int nick_canonicalize(const struct ruleset *rs, const char *nick, UChar *canon, int32_t *canon_len, uint8_t *key, int keysize) {
+    UChar u_nick[NC_CANON_MAX];
+    UErrorCode status = U_ZERO_ERROR;
+    size_t nicklen = strlen(nick);
+    int32_t len;
+    NC_TIME_START(t);
+
+    if (nick_fast_eligible(rs, nick, nicklen)) {
+        // No mapping applies, so the nick widened to UTF-16 is already canonical
+        for (len = 0; len < (int32_t)nicklen; len++) {
+            canon[len] = (UChar)(uint8_t)nick[len];
+        }
+        canon[len] = 0;
+        NC_TIME_LAP(NC_STAGE_CONVERT, t);
+        if (rs->collator == NULL) {
+            nc_fast_hits++;
+        } else {
+            nc_fast_collated++;
+        }
+    } else {
+        nc_icu_path++;
+        u_strFromUTF8(u_nick, NC_CANON_MAX, &len, nick, nicklen, &status);
+        if (U_FAILURE(status) || status == U_STRING_NOT_TERMINATED_WARNING) {
+            return -1;
+        }
+        NC_TIME_LAP(NC_STAGE_CONVERT, t);
+
+        // UTS #39: skeleton(X) = NFD(map(NFD(X)))
+        if (rs->skeleton.map && (len = nfd_normalize(u_nick, len, NC_CANON_MAX)) < 0) {
+            return -1;
+        }
+
+        len = apply_collator_mapping(rs, u_nick, len, canon, NC_CANON_MAX);
+        if (len < 0) {
+            return -1;
+        }
+
+        if (rs->skeleton.map && (len = nfd_normalize(canon, len, NC_CANON_MAX)) < 0) {
+            return -1;
+        }
+        NC_TIME_LAP(NC_STAGE_MAPPING, t);
+    }
+    *canon_len = len;
+
+    if (rs->collator != NULL) {
+        // ICU sort keys cannot be reproduced without ICU, so collation stays here
+        len = ucol_getSortKey(rs->collator, canon, len, key, keysize);
+        NC_TIME_END(NC_STAGE_COLLATE, t);
+        return (len > 0 && len <= keysize) ? len : -1;
+    }
+
+    if (len * (int)sizeof(UChar) > keysize) {
+        return -1;
+    }
+    memcpy(key, canon, len * sizeof(UChar));
+    NC_TIME_END(NC_STAGE_COLLATE, t);
+    return len * sizeof(UChar);
+}
+
+int nick_canonical_key(const struct ruleset *rs, const char *nick, uint8_t *key, int keysize) {
+    UChar canon[NC_CANON_MAX];
+    int32_t canon_len;
+
+    return nick_canonicalize(rs, nick, canon, &canon_len, key, keysize);
+}
+
+// Fingerprint of a rule set, so a REHASH that changes nothing keeps the index
+static uint64_t rules_fingerprint(const struct ruleset *rs) {
+    static const char fpkey[SIPHASH_KEY_LENGTH] = "nickcollator-fp";
+    uint64_t fp = siphash_raw((const char *)&rs->collator_strength, sizeof(rs->collator_strength), fpkey);
+    int i, j;
+
+    for (i = 0; i < muhcfg.num_mappings; i++) {
+        for (j = 0; j < muhcfg.mappings[i].num_equivalents; j++) {
+            fp = fp * 31 + siphash(muhcfg.mappings[i].equivalents[j], fpkey);
+        }
+        fp = fp * 31 + i;
+    }
+    fp = fp * 31 + (rs->collator != NULL);
+    fp = fp * 31 + rs->skeleton.fingerprint;
+    fp = fp * 31 + rs->protect_channels;
+    for (i = 0; i < muhcfg.num_protected; i++) {
+        fp = fp * 31 + siphash(muhcfg.protected[i].nick, fpkey);
+        fp = fp * 31 + (muhcfg.protected[i].account ? siphash(muhcfg.protected[i].account, fpkey) : 0);
+    }
+    return fp;
+}
+
+static uint64_t protected_hash(const struct ruleset *rs, const uint8_t *key, int keylen) {
+    uint64_t hashv = siphash_raw((const char *)key, keylen, rs->protected_siphashkey);
+    return hashv ? hashv : 1;
+}
+
+// Canonicalize the protected nicks once, into a hash set sized to at most half full
+static void protected_compile(struct ruleset *rs) {
+    uint8_t key[NC_KEY_MAX];
+    uint32_t i, mask;
+    int n, keylen;
+
+    if (muhcfg.num_protected == 0) {
+        return;
+    }
+    for (rs->protected_size = 16; rs->protected_size < (uint32_t)muhcfg.num_protected * 2; rs->protected_size *= 2);
+    rs->protected = safe_alloc(sizeof(struct protected_entry) * rs->protected_size);
+    siphash_generate_key(rs->protected_siphashkey);
+    mask = rs->protected_size - 1;
+
+    for (n = 0; n < muhcfg.num_protected; n++) {
+        struct protected_nick *pn = &muhcfg.protected[n];
+        uint64_t hashv;
+
+        keylen = nick_canonical_key(rs, pn->nick, key, sizeof(key));
+        if (keylen < 0) {
+            config_warn("[nickcollator] Ignoring protected nick '%s': not valid UTF-8 or too long", pn->nick);
+            continue;
+        }
+        hashv = protected_hash(rs, key, keylen);
+        for (i = hashv & mask; rs->protected[i].hashv; i = (i + 1) & mask) {
+            if (rs->protected[i].hashv == hashv && rs->protected[i].keylen == keylen &&
+                !memcmp(rs->protected[i].key, key, keylen)) {
+                break; // A lookalike of an earlier entry, which already covers it
+            }
+        }
+        if (rs->protected[i].hashv) {
+            continue;
+        }
+        rs->protected[i].hashv = hashv;
+        rs->protected[i].keylen = keylen;
+        rs->protected[i].key = safe_alloc(keylen);
+        memcpy(rs->protected[i].key, key, keylen);
+        rs->protected[i].nick = strdup(pn->nick);
+        rs->protected[i].account = pn->account ? strdup(pn->account) : NULL;
+    }
+}
+
+// Find the protected nick with the given canonical key, or NULL
+static const struct protected_entry *protected_find(const struct ruleset *rs, const uint8_t *key, int keylen) {
+    uint32_t i, mask = rs->protected_size - 1;
+    uint64_t hashv;
+
+    if (!rs->protected_size) {
+        return NULL;
+    }
+    hashv = protected_hash(rs, key, keylen);
+    for (i = hashv & mask; rs->protected[i].hashv; i = (i + 1) & mask) {
+        if (rs->protected[i].hashv == hashv && rs->protected[i].keylen == keylen &&
+            !memcmp(rs->protected[i].key, key, keylen)) {
+            return &rs->protected[i];
+        }
+    }
+    return NULL;
+}
+
+// Compile the configured mappings, skeleton table and collator strength into a
+// new rule set. Returns NULL on failure, leaving the rules in use untouched.
+struct ruleset *ruleset_compile(void) {
+    struct ruleset *rs = safe_alloc(sizeof(struct ruleset));
+
+    rs->collator_strength = muhcfg.collator_strength;
+    rs->protect_channels = muhcfg.protect_channels;
+    if (!mapping_compile(&rs->trie)) {
+        ruleset_free(rs);
+        return NULL;
+    }
+
+    // The skeleton table was already validated in configtest
+    if (muhcfg.skeleton_file) {
+        char *errstr = NULL;
+
+        if (!skeleton_load(&rs->skeleton, muhcfg.skeleton_file, &errstr)) {
+            config_error("[nickcollator] Cannot load skeleton table %s: %s", muhcfg.skeleton_file, errstr);
+            ruleset_free(rs);
+            return NULL;
+        }
+        skeleton_mark_ascii(&rs->skeleton, rs->trie.ascii_lut);
+    }
+
+    if (rs->collator_strength != -1) {  // only if collator should be used
+        rs->collator = collator_open(rs->collator_strength);
+    }
+    protected_compile(rs); // Needs the rest of the rules for the keys
+    rs->fingerprint = rules_fingerprint(rs);
+    return rs;
+}
+
+void ruleset_free(struct ruleset *rs) {
+    uint32_t i;
+
+    if (!rs) {
+        return;
+    }
+    if (rs->collator != NULL) {
+        ucol_close(rs->collator); // Close ICU collator
+    }
+    for (i = 0; i < rs->protected_size; i++) {
+        safe_free(rs->protected[i].key);
+        safe_free(rs->protected[i].nick);
+        safe_free(rs->protected[i].account);
+    }
+    safe_free(rs->protected);
+    trie_free(&rs->trie);
+    skeleton_unload(&rs->skeleton);
+    safe_free(rs);
+}
+
+// Create an empty index for a rule set; the index takes ownership of the rules
+static struct nick_index *nick_index_new(struct ruleset *rules, int slot) {
+    struct nick_index *idx = safe_alloc(sizeof(struct nick_index));
+    int t;
+
+    for (t = 0; t < NC_NUM_TABLES; t++) {
+        idx->buckets[t] = safe_alloc(sizeof(struct nick_entry *) * NC_INDEX_SIZE);
+    }
+    idx->bloom[NC_TABLE_NICKS] = safe_alloc(NC_BLOOM_SIZE);
+    if (rules->protect_channels) {
+        idx->bloom[NC_TABLE_CHANNELS] = safe_alloc(NC_BLOOM_SIZE);
+    }
+    idx->rejects = safe_alloc(sizeof(struct reject_entry) * NC_REJECT_CACHE);
+    siphash_generate_key(idx->siphashkey);
+    idx->rules = rules;
+    idx->slot = slot;
+    return idx;
+}
+
+static uint64_t nick_index_hash(const struct nick_index *idx, const uint8_t *key, int keylen) {
+    return siphash_raw((const char *)key, keylen, idx->siphashkey);
+}
+
+// Counter positions of a key in a Bloom filter, by double hashing its hash
+#define BLOOM_POS(hashv, i) (((hashv) + (i) * (((hashv) >> 32) | 1)) & (NC_BLOOM_SIZE - 1))
+
+// Counters saturate and then stay, which only costs some false positives
+static void bloom_add(uint8_t *bloom, uint64_t hashv) {
+    int i;
+
+    for (i = 0; i < NC_BLOOM_HASHES; i++) {
+        if (bloom[BLOOM_POS(hashv, i)] < UINT8_MAX) {
+            bloom[BLOOM_POS(hashv, i)]++;
+        }
+    }
+}
 
-// Global ICU collator (used for comparing strings based on rules)
-static UCollator *collator = NULL;
+static void bloom_del(uint8_t *bloom, uint64_t hashv) {
+    int i;
 
-// Function to initialize the configuration with default values
-void setcfg(void) {
-    muhcfg.mappings = NULL;       // Set mappings to NULL (empty at start)
-    muhcfg.num_mappings = 0;      // Set number of mappings to zero
-    muhcfg.got_mapping = 0;       // Indicate that no mappings are yet defined
-    muhcfg.collator_strength = -1;     // Default to "off" for collator strength
+    for (i = 0; i < NC_BLOOM_HASHES; i++) {
+        if (bloom[BLOOM_POS(hashv, i)] < UINT8_MAX) {
+            bloom[BLOOM_POS(hashv, i)]--;
+        }
+    }
 }
 
-// Function to free memory used by configuration
-void freecfg(void) {
-    int i, j;
-    // Free each equivalent string within each mapping
-    for (i = 0; i < muhcfg.num_mappings; i++) {
-        for (j = 0; j < muhcfg.mappings[i].num_equivalents; j++) {
-            safe_free(muhcfg.mappings[i].equivalents[j]);
+// Returns 0 if no key with this hash is in the table, 1 if it may be
+static int bloom_test(const uint8_t *bloom, uint64_t hashv) {
+    int i;
+
+    for (i = 0; i < NC_BLOOM_HASHES; i++) {
+        if (!bloom[BLOOM_POS(hashv, i)]) {
+            return 0;
         }
-        safe_free(muhcfg.mappings[i].equivalents); // Free the equivalents array
     }
-    safe_free(muhcfg.mappings); // Free the mappings array itself
+    return 1;
 }
 
-// Initialize ICU collator (for comparing strings)
-static void collator_init(void) {
-    UErrorCode status = U_ZERO_ERROR;
+// Unlink an entry from its index, detach it from its cache and free it
+static void nick_entry_free(struct nick_entry *e) {
+    struct nick_entry **pe;
 
-    if (muhcfg.collator_strength != -1) {   // only if collator should be used
-        collator = ucol_open("", &status);  // Open a default collator
-        if (U_FAILURE(status)) {            // Check if it failed
-            config_error("ICU collator could not be initialized: %s", u_errorName(status));
+    for (pe = &e->index->buckets[e->table][e->hashv & (NC_INDEX_SIZE - 1)]; *pe; pe = &(*pe)->next) {
+        if (*pe == e) {
+            *pe = e->next;
+            break;
         }
-        ucol_setStrength(collator, muhcfg.collator_strength); // Set collation strength
     }
+    e->index->count[e->table]--;
+    if (e->index->bloom[e->table]) {
+        bloom_del(e->index->bloom[e->table], e->hashv);
+    }
+    e->cache->entry[e->index->slot] = NULL;
+    safe_free(e);
 }
 
-// Function to apply mappings to a Unicode string
-void apply_collator_mapping(UChar *u_str, int32_t length) {
-    UErrorCode status = U_ZERO_ERROR;
+// Compute the entry of a name under the index's rules
+static struct nick_entry *nick_entry_compute(struct nick_index *idx, const char *name) {
+    UChar canon[NC_CANON_MAX];
+    uint8_t key[NC_KEY_MAX];
+    struct nick_entry *e;
+    int32_t canon_len;
+    int keylen;
 
-    // Go through all mappings and apply equivalents
-    for (int i = 0; i < muhcfg.num_mappings; i++) {
-        struct mapping *current_mapping = &muhcfg.mappings[i];
-        for (int j = 0; j < current_mapping->num_equivalents; j++) {
-            for (int k = 0; k < current_mapping->num_equivalents; k++) {
-                if (j == k) continue;  // Skip if mapping to itself
+    keylen = nick_canonicalize(idx->rules, name, canon, &canon_len, key, sizeof(key));
+    if (keylen < 0) {
+        return NULL; // Not representable, the core checks still apply
+    }
 
-                // Convert both source and target equivalents to Unicode
-                UChar u_from[10];
-                UChar u_to[10];
+    e = safe_alloc(sizeof(struct nick_entry) + canon_len * sizeof(UChar) + keylen);
+    e->index = idx;
+    e->canon = (UChar *)e->data;
+    e->canon_len = canon_len;
+    u_memcpy(e->canon, canon, canon_len);
+    e->key = e->data + canon_len * sizeof(UChar);
+    e->keylen = keylen;
+    memcpy(e->key, key, keylen);
+    e->hashv = nick_index_hash(idx, e->key, keylen);
+    return e;
+}
 
-                // Convert both source and target equivalents to Unicode
-                int32_t from_len, to_len;
-                u_strFromUTF8(u_from, 10, &from_len, current_mapping->equivalents[j], -1, &status);
-                u_strFromUTF8(u_to, 10, &to_len, current_mapping->equivalents[k], -1, &status);
+// Add a name to a table of an index, unless the owner is already in it.
+// 'md' is the owner's ModData slot holding its struct nick_cache.
+static void nick_index_insert(struct nick_index *idx, int table, ModData *md, void *owner, const char *name) {
+    struct nick_cache *cache = md->ptr;
+    struct nick_entry *e;
+    uint32_t b;
 
-                if (U_FAILURE(status)) {
-                    continue; // Skip if conversion fails
-                }
+    if (!cache) {
+        cache = safe_alloc(sizeof(struct nick_cache));
+        md->ptr = cache;
+    }
+    if (cache->entry[idx->slot]) {
+        return;
+    }
+    e = nick_entry_compute(idx, name);
+    if (!e) {
+        return;
+    }
+    e->table = table;
+    e->owner = owner;
+    e->cache = cache;
+    b = e->hashv & (NC_INDEX_SIZE - 1);
+    e->next = idx->buckets[table][b];
+    idx->buckets[table][b] = e;
+    idx->count[table]++;
+    if (idx->bloom[table]) {
+        bloom_add(idx->bloom[table], e->hashv);
+    }
+    cache->entry[idx->slot] = e;
+}
+
+// Find an owner other than 'self' whose name has the given canonical key.
+// The existing side is a plain memcmp against the cached keys.
+static void *nick_index_lookup(const struct nick_index *idx, int table, const uint8_t *key, int keylen, const void *self) {
+    struct nick_entry *e;
+    uint64_t hashv = nick_index_hash(idx, key, keylen);
+
+    // A definite miss in the Bloom filter saves walking the bucket
+    if (idx->bloom[table] && !bloom_test(idx->bloom[table], hashv)) {
+        nc_bloom_negatives++;
+        return NULL;
+    }
+    for (e = idx->buckets[table][hashv & (NC_INDEX_SIZE - 1)]; e; e = e->next) {
+        if (e->hashv == hashv && e->keylen == keylen && e->owner != self &&
+            !memcmp(e->key, key, keylen)) {
+            return e->owner;
+        }
+    }
+    if (idx->bloom[table]) {
+        nc_bloom_false_positives++;
+    }
+    return NULL;
+}
 
-                // Look for occurrences of u_from in the input string and replace them with u_to
-                UChar *pos = u_strstr(u_str, u_from);
-                while (pos) {
-                    // Shift the remaining part of the string to accommodate the replacement
-                    u_memmove(pos + to_len, pos + from_len, u_strlen(pos + from_len) + 1);
+// Add a client to an index under its current name, unless it is already in it
+static void nick_index_add(struct nick_index *idx, Client *client) {
+    nick_index_insert(idx, NC_TABLE_NICKS, &moddata_client(client, nick_cache_md), client, client->name);
+}
 
-                    // Replace by copying u_to into position of u_from
-                    u_memcpy(pos, u_to, to_len);
+// Remove a client from an index
+static void nick_index_del(struct nick_index *idx, Client *client) {
+    struct nick_cache *cache = NICK_CACHE(client);
 
-                    // Move to the next occurrence
-                    pos = u_strstr(pos + to_len, u_from);
-                }
+    if (cache && cache->entry[idx->slot]) {
+        nick_entry_free(cache->entry[idx->slot]);
+    }
+}
+
+static Client *nick_index_find(const struct nick_index *idx, const uint8_t *key, int keylen, Client *self) {
+    return nick_index_lookup(idx, NC_TABLE_NICKS, key, keylen, self);
+}
+
+// Check whether a new nick collides with a user other than 'self'. A nick
+// that was rejected recently is answered from the reject cache without being
+// canonicalized again, as long as a user with the same key hash is still
+// there. Returns 0 and sets 'other' to the colliding user or NULL, or -1 if
+// the nick cannot be canonicalized (invalid UTF-8, or too long once mapped).
+// If there is no collision and 'prot' is given, it is set to the protected
+// nick the new nick collates equal to, if any.
+static int nick_index_check(struct nick_index *idx, const char *nick, Client *self,
+                            Client **other, const struct protected_entry **prot) {
+    uint8_t key[NC_KEY_MAX];
+    struct reject_entry *r;
+    struct nick_entry *e;
+    uint64_t nickhash = siphash(nick, idx->siphashkey);
+    int keylen;
+    NC_TIME_START(t);
+
+    *other = NULL;
+    if (prot) {
+        *prot = NULL;
+    }
+    r = &idx->rejects[nickhash & (NC_REJECT_CACHE - 1)];
+    if (r->nickhash == nickhash) {
+        for (e = idx->buckets[NC_TABLE_NICKS][r->keyhash & (NC_INDEX_SIZE - 1)]; e; e = e->next) {
+            if (e->hashv == r->keyhash && e->owner != self) {
+                nc_reject_hits++;
+                NC_TIME_END(NC_STAGE_LOOKUP, t);
+                *other = e->owner;
+                return 0;
             }
         }
+        r->nickhash = 0; // The user it collided with is gone
+    }
+    nc_reject_misses++;
+
+    keylen = nick_canonical_key(idx->rules, nick, key, sizeof(key));
+    if (keylen < 0) {
+        return -1;
+    }
+    NC_TIME_RESET(t); // The stages of canonicalization are timed on their own
+    *other = nick_index_find(idx, key, keylen, self);
+    if (*other) {
+        r->nickhash = nickhash;
+        r->keyhash = nick_index_hash(idx, key, keylen);
+    } else if (prot) {
+        *prot = protected_find(idx->rules, key, keylen);
     }
+    NC_TIME_END(NC_STAGE_LOOKUP, t);
+    return 0;
 }
 
+// Add a channel to an index, if the index's rules protect channel names.
+// Channels never change their name, so there is no counterpart to remove one:
+// the entry goes away with the channel's ModData.
+static void chan_index_add(struct nick_index *idx, Channel *channel) {
+    if (idx->rules->protect_channels) {
+        nick_index_insert(idx, NC_TABLE_CHANNELS, &moddata_channel(channel, chan_cache_md), channel, channel->name);
+    }
+}
 
-// Function to compare two nicknames after applying mappings
-int compare_nicks(const char *nick1, const char *nick2) {
-    UChar u_nick1[100];
-    UChar u_nick2[100];
+// ModData free function for both clients and channels
+void nick_cache_md_free(ModData *md) {
+    struct nick_cache *cache = md->ptr;
+    int i;
 
-    UErrorCode status = U_ZERO_ERROR;
+    if (cache) {
+        for (i = 0; i < 2; i++) {
+            if (cache->entry[i]) {
+                nick_entry_free(cache->entry[i]);
+            }
+        }
+        safe_free(md->ptr);
+    }
+}
 
-    // Convert nicknames from UTF-8 to Unicode
-    u_strFromUTF8(u_nick1, 100, NULL, nick1, -1, &status);
-    u_strFromUTF8(u_nick2, 100, NULL, nick2, -1, &status);
+// Index every user and channel already known to us in one go, e.g. on a fresh load
+static void nick_index_build(struct nick_index *idx) {
+    Client *acptr;
+    Channel *channel;
 
-    if (U_FAILURE(status)) {
-        return 0; // Return 0 if conversion fails
+    list_for_each_entry(acptr, &client_list, client_node) {
+        if (IsUser(acptr)) {
+            nick_index_add(idx, acptr);
+        }
+    }
+    for (channel = channels; channel; channel = channel->nextch) {
+        chan_index_add(idx, channel);
     }
+}
 
-    // Apply mappings to both nicknames
-    apply_collator_mapping(u_nick1, u_strlen(u_nick1));
-    apply_collator_mapping(u_nick2, u_strlen(u_nick2));
+// Free an index with all its entries and its rule set
+static void nick_index_free(struct nick_index *idx) {
+    uint32_t b;
+    int t;
 
-    // Compare the nicknames without the ICU collator IF collator_strength !=off
-    if (muhcfg.collator_strength == -1) {
-        return u_strcmp(u_nick1, u_nick2) == 0 ? 0 : 1;
+    if (!idx) {
+        return;
+    }
+    for (t = 0; t < NC_NUM_TABLES; t++) {
+        for (b = 0; b < NC_INDEX_SIZE; b++) {
+            while (idx->buckets[t][b]) {
+                nick_entry_free(idx->buckets[t][b]);
+            }
+        }
+        safe_free(idx->buckets[t]);
+        safe_free(idx->bloom[t]);
     }
+    safe_free(idx->rejects);
+    ruleset_free(idx->rules);
+    safe_free(idx);
+}
+
+#ifndef NICKCOLLATOR_STANDALONE
+// Whether a client may use a protected nick: it is logged in to the owning account
+static int protected_exempt(Client *client, const struct protected_entry *prot) {
+    return prot->account && IsLoggedIn(client) && !strcasecmp(client->user->account, prot->account);
+}
 
-    // Compare the nicknames using the ICU collator
-    return ucol_strcoll(collator, u_nick1, -1, u_nick2, -1);
+// Whether a user is using a protected nick it does not own, by its indexed key
+static int protected_violation(Client *client) {
+    struct nick_cache *cache = NICK_CACHE(client);
+    struct nick_entry *e = cache ? cache->entry[nc_state->active->slot] : NULL;
+    const struct protected_entry *prot;
+
+    if (!e || !(prot = protected_find(nc_state->active->rules, e->key, e->keylen))) {
+        return 0;
+    }
+    return !protected_exempt(client, prot);
 }
 
 // Override function for /NICK command to enforce nickname checks
 CMD_OVERRIDE_FUNC(override_nick) {
-    const char *newnick = parv[1]; // Get new nickname from parameters
+    const struct protected_entry *prot;
+    Client *other;
+
+    if (parc < 2 || BadPtr(parv[1])) {
+        CALL_NEXT_COMMAND_OVERRIDE();
+        return;
+    }
+
+    // The core cuts the nick to the configured length before using it, so
+    // that is what gets checked
+    char newnick[NICKLEN + 2];
+    strlcpy(newnick, parv[1], iConf.nick_length + 1);
+    NC_TIME_START(t);
+
+    // One lookup replaces comparing against every client; the client's own
+    // entry is skipped so changes to an equivalent form of its nick are allowed.
+    // Checks always use the active rules, even while an index for new rules is
+    // built. A nick we cannot convert (invalid UTF-8, or too long once mapped)
+    // is refused: it could collate equal to anyone, and letting it through
+    // unchecked would be a way around the module.
+    nc_nick_checks++;
+    if (nick_index_check(nc_state->active, newnick, client, &other, &prot) < 0) {
+        NC_TIME_END(NC_STAGE_TOTAL, t);
+        nc_nick_uncheckable++;
+        nc_nick_rejected++;
+        sendnumeric(client, ERR_ERRONEUSNICKNAME, newnick, "This nick cannot be checked for lookalikes");
+        return;
+    }
+    NC_TIME_END(NC_STAGE_TOTAL, t);
+    if (other) {
+        // Send error if the nickname is already in use by someone else
+        nc_nick_rejected++;
+        sendnumeric(client, ERR_NICKNAMEINUSE, newnick);
+        return;
+    }
+
+    // Protected nicks are refused to anyone but their owner. Before
+    // registration the account is not known yet (SASL), so that case is
+    // checked once the user is connected instead.
+    if (prot && IsUser(client) && !protected_exempt(client, prot)) {
+        nc_protected_refused++;
+        nc_nick_rejected++;
+        sendnumeric(client, ERR_ERRONEUSNICKNAME, newnick, "This nick is reserved");
+        return;
+    }
+
+    // If no collision, continue with the original /NICK command
+    CALL_NEXT_COMMAND_OVERRIDE();
+}
+
+// Add a client to the active index and to the one being built, if any
+static void nick_index_add_all(Client *client) {
+    nick_index_add(nc_state->active, client);
+    if (nc_state->pending) {
+        nick_index_add(nc_state->pending, client);
+    }
+}
+
+static void nick_index_del_all(Client *client) {
+    nick_index_del(nc_state->active, client);
+    if (nc_state->pending) {
+        nick_index_del(nc_state->pending, client);
+    }
+}
+
+static const char *collision_policy_name(int policy) {
+    switch (policy) {
+        case NC_COLLISION_RENAME: return "rename";
+        case NC_COLLISION_REJECT: return "reject";
+        default: return "log";
+    }
+}
+
+// Of two colliding users the one that took its nick last loses, with the UID
+// as tie breaker, so every server running the module picks the same one
+static Client *collision_loser(Client *a, Client *b) {
+    if (a->lastnick != b->lastnick) {
+        return a->lastnick > b->lastnick ? a : b;
+    }
+    return strcmp(a->id, b->id) > 0 ? a : b;
+}
+
+// Find a user other than 'client' whose nick collates equal to the one the
+// client is indexed under. A single lookup with the already computed key.
+static Client *collision_find(Client *client) {
+    struct nick_cache *cache = NICK_CACHE(client);
+    struct nick_entry *e = cache ? cache->entry[nc_state->active->slot] : NULL;
+
+    if (!e) {
+        return NULL;
+    }
+    return nick_index_find(nc_state->active, e->key, e->keylen, client);
+}
+
+// Check a user that was just introduced or got a new nick without passing our
+// NICK override: remote users (including whole bursts) and forced changes.
+// Losers that are local are acted on from an event, outside of the hook.
+static void collision_enqueue(Client *client);
+
+static void collision_check(Client *client) {
+    Client *other, *loser;
+
+    if (IsULine(client) || !(other = collision_find(client)) || IsULine(other)) {
+        return;
+    }
+    nc_collisions++;
+    loser = collision_loser(client, other);
+    unreal_log(ULOG_WARNING, "nickcollator", "NICKCOLLATOR_COLLISION", loser,
+               "Nick $client collates equal to $other_nick (policy: $policy)",
+               log_data_string("other_nick", loser == client ? other->name : client->name),
+               log_data_string("policy", collision_policy_name(muhcfg.collision_policy)));
+
+    if (muhcfg.collision_policy == NC_COLLISION_LOG || !MyUser(loser)) {
+        return; // A remote loser is handled by its own server
+    }
+    collision_enqueue(loser);
+}
+
+// Queue a local user for nickcollator_collisions
+static void collision_enqueue(Client *client) {
+    struct nc_state *st = nc_state;
+
+    if (st->collision_queue_len == st->collision_queue_size) {
+        st->collision_queue_size = st->collision_queue_size ? st->collision_queue_size * 2 : 16;
+        st->collision_queue = realloc(st->collision_queue, sizeof(*st->collision_queue) * st->collision_queue_size);
+    }
+    strlcpy(st->collision_queue[st->collision_queue_len++], client->id, IDLEN + 1);
+}
+
+// Change the nick of a local user. The core's SVSNICK does it, so channels,
+// servers, WHOWAS and the WATCH/MONITOR notifications all see a nick change.
+static void nick_force_change(Client *client, const char *newnick) {
+    char tsbuf[32];
+    const char *parv[5];
+
+    snprintf(tsbuf, sizeof(tsbuf), "%lld", (long long)TStime());
+    parv[0] = NULL;
+    parv[1] = client->id;
+    parv[2] = newnick;
+    parv[3] = tsbuf;
+    parv[4] = NULL;
+    do_cmd(&me, NULL, "SVSNICK", 4, parv);
+}
+
+// Rename users that registered with a protected nick they do not own, and
+// apply the collision policy to the queued local losers that still collide
+EVENT(nickcollator_collisions) {
+    struct nc_state *st = nc_state;
+    int i;
 
-    // Check if the new nickname is equivalent to the current nickname
-    if (compare_nicks(newnick, client->name) == 0) {
-        // If the new nickname is equivalent to the current nickname, allow the change
+    for (i = 0; i < st->collision_queue_len; i++) {
+        Client *client = find_client(st->collision_queue[i], NULL);
+        char newnick[NICKLEN + 1];
+        int protected;
+
+        if (!client || !MyUser(client) || IsDead(client)) {
+            continue;
+        }
+        protected = protected_violation(client);
+        if (!protected && !collision_find(client)) {
+            continue; // Resolved in the meantime
+        }
+        if (!protected && muhcfg.collision_policy == NC_COLLISION_REJECT) {
+            nc_collisions_rejected++;
+            exit_client(client, NULL, "Nick collision with a lookalike nick");
+            continue;
+        }
+        snprintf(newnick, sizeof(newnick), "%s%s", NC_RENAME_PREFIX, client->id);
+        if (!strcmp(client->name, newnick) || find_client(newnick, NULL)) {
+            continue; // Renaming again would not help
+        }
+        if (protected) {
+            nc_protected_renamed++;
+            sendnotice(client, "*** Your nick is reserved, it was changed to %s", newnick);
+        } else {
+            nc_collisions_renamed++;
+            sendnotice(client, "*** Your nick collides with the lookalike nick of another user, it was changed to %s", newnick);
+        }
+        nick_force_change(client, newnick);
+    }
+    st->collision_queue_len = 0;
+}
+
+// Keep the canonical nick indexes in sync with connects, nick changes and quits
+int nickcollator_connect(Client *client) {
+    nick_index_add_all(client);
+    collision_check(client);
+    if (MyUser(client) && protected_violation(client)) {
+        collision_enqueue(client); // Picked a protected nick before logging in
+    }
+    return HOOK_CONTINUE;
+}
+
+int nickcollator_quit(Client *client, MessageTag *mtags, const char *comment) {
+    nick_index_del_all(client);
+    return HOOK_CONTINUE;
+}
+
+int nickcollator_pre_nickchange(Client *client, MessageTag *mtags, const char *newnick) {
+    nick_index_del_all(client);
+    return HOOK_CONTINUE;
+}
+
+int nickcollator_post_nickchange(Client *client, MessageTag *mtags, const char *oldnick) {
+    nick_index_add_all(client);
+    collision_check(client);
+    return HOOK_CONTINUE;
+}
+
+int nickcollator_channel_create(Channel *channel) {
+    chan_index_add(nc_state->active, channel);
+    if (nc_state->pending) {
+        chan_index_add(nc_state->pending, channel);
+    }
+    return HOOK_CONTINUE;
+}
+
+static Channel *chan_index_find(const struct nick_index *idx, const uint8_t *key, int keylen) {
+    return nick_index_lookup(idx, NC_TABLE_CHANNELS, key, keylen, NULL);
+}
+
+// Override function for /JOIN: refuse to create a channel whose name collates
+// equal to an existing channel. Joining existing channels is not affected.
+CMD_OVERRIDE_FUNC(override_join) {
+    char names[BUFSIZE], keys[BUFSIZE], newnames[BUFSIZE], newkeys[BUFSIZE];
+    const char *newparv[4];
+    char *name, *key, *p = NULL, *pk = NULL;
+    uint8_t ckey[NC_KEY_MAX];
+    int keylen, refused = 0;
+
+    if (!MyUser(client) || parc < 2 || BadPtr(parv[1]) || !strcmp(parv[1], "0") ||
+        !nc_state->active->rules->protect_channels) {
+        CALL_NEXT_COMMAND_OVERRIDE();
+        return;
+    }
+
+    // Rebuild the channel and key lists without the refused channels. Keys
+    // are positional, so the keys of the channels that are kept stay a prefix.
+    strlcpy(names, parv[1], sizeof(names));
+    strlcpy(keys, (parc > 2 && parv[2]) ? parv[2] : "", sizeof(keys));
+    *newnames = *newkeys = '\0';
+    key = strtoken(&pk, keys, ",");
+    for (name = strtoken(&p, names, ","); name; name = strtoken(&p, NULL, ","), key = key ? strtoken(&pk, NULL, ",") : NULL) {
+        if (!find_channel(name) &&
+            (keylen = nick_canonical_key(nc_state->active->rules, name, ckey, sizeof(ckey))) >= 0 &&
+            chan_index_find(nc_state->active, ckey, keylen)) {
+            sendnumeric(client, ERR_FORBIDDENCHANNEL, name, "Channel name is too similar to an existing channel");
+            refused++;
+            continue;
+        }
+        if (*newnames) {
+            strlcat(newnames, ",", sizeof(newnames));
+        }
+        strlcat(newnames, name, sizeof(newnames));
+        if (key) {
+            if (*newkeys) {
+                strlcat(newkeys, ",", sizeof(newkeys));
+            }
+            strlcat(newkeys, key, sizeof(newkeys));
+        }
+    }
+
+    if (!refused) {
         CALL_NEXT_COMMAND_OVERRIDE();
         return;
     }
+    if (!*newnames) {
+        return; // Every channel was refused
+    }
+    newparv[0] = parv[0];
+    newparv[1] = newnames;
+    newparv[2] = *newkeys ? newkeys : NULL;
+    newparv[3] = NULL;
+    CallCommandOverride(ovr, client, recv_mtags, *newkeys ? 3 : 2, newparv);
+}
+
+// Drop the snapshot of a finished or superseded rebuild
+static void nc_rebuild_clear(struct nc_state *st) {
+    int i;
+
+    for (i = 0; i < st->rebuild_channel_count; i++) {
+        safe_free(st->rebuild_channels[i]);
+    }
+    safe_free(st->rebuild_channels);
+    safe_free(st->rebuild_ids);
+    st->rebuild_count = st->rebuild_pos = 0;
+    st->rebuild_channel_count = st->rebuild_channel_pos = 0;
+}
 
+// Start building an index for new rules. The users online now are remembered
+// by ID (and the channels by name) and added in batches by nickcollator_rebuild;
+// users connecting or changing nick in the meantime are added by the hooks above.
+static void nc_rebuild_start(struct ruleset *rules) {
+    struct nc_state *st = nc_state;
     Client *acptr;
+    Channel *channel;
+    int n = 0;
 
-    // Check each client's nickname against the new nickname for collisions
+    if (st->pending && st->pending->rules->fingerprint == rules->fingerprint) {
+        ruleset_free(rules); // Same rules as the rebuild already running
+        return;
+    }
+    // A newer REHASH supersedes a rebuild that has not finished yet
+    nick_index_free(st->pending);
+    st->pending = NULL;
+    nc_rebuild_clear(st);
+
+    if (st->active->rules->fingerprint == rules->fingerprint) {
+        ruleset_free(rules); // Nothing changed, keep the current index
+        return;
+    }
+
+    list_for_each_entry(acptr, &client_list, client_node) {
+        if (IsUser(acptr)) {
+            n++;
+        }
+    }
+    st->pending = nick_index_new(rules, !st->active->slot);
+    st->rebuild_ids = safe_alloc(sizeof(*st->rebuild_ids) * (n + 1));
     list_for_each_entry(acptr, &client_list, client_node) {
-        if (compare_nicks(newnick, acptr->name) == 0) {
-            // Send error if the nickname is already in use by someone else
-            sendnumeric(client, ERR_NICKNAMEINUSE, newnick);
-            return;
+        if (IsUser(acptr) && st->rebuild_count < n) {
+            strlcpy(st->rebuild_ids[st->rebuild_count++], acptr->id, IDLEN + 1);
+        }
+    }
+    if (rules->protect_channels) {
+        for (n = 0, channel = channels; channel; channel = channel->nextch) {
+            n++;
+        }
+        st->rebuild_channels = safe_alloc(sizeof(char *) * (n + 1));
+        for (channel = channels; channel && st->rebuild_channel_count < n; channel = channel->nextch) {
+            safe_strdup(st->rebuild_channels[st->rebuild_channel_count++], channel->name);
         }
     }
+    unreal_log(ULOG_INFO, "nickcollator", "NICKCOLLATOR_REBUILD_START", NULL,
+               "Rules changed, rebuilding the nick index for $count users",
+               log_data_integer("count", st->rebuild_count));
+}
 
-    // If no collision, continue with the original /NICK command
-    CALL_NEXT_COMMAND_OVERRIDE();
+// All users are in the pending index: make it the active one in a single step
+static void nc_rebuild_finish(void) {
+    struct nc_state *st = nc_state;
+    struct nick_index *old = st->active;
+
+    st->active = st->pending;
+    st->pending = NULL;
+    nc_rebuild_clear(st);
+    nick_index_free(old); // Also closes the old collator
+
+    if (rebuild_event) {
+        EventDel(rebuild_event);
+        rebuild_event = NULL;
+    }
+    unreal_log(ULOG_INFO, "nickcollator", "NICKCOLLATOR_REBUILD_DONE", NULL,
+               "Nick index rebuilt, the new rules are active");
+}
+
+// Add the next batch of users, then channels, to the pending index
+EVENT(nickcollator_rebuild) {
+    struct nc_state *st = nc_state;
+    int n;
+
+    if (!st->pending) {
+        return;
+    }
+    for (n = 0; n < NC_REBUILD_BATCH && st->rebuild_pos < st->rebuild_count; n++) {
+        Client *acptr = find_client(st->rebuild_ids[st->rebuild_pos++], NULL);
+        if (acptr && IsUser(acptr)) {
+            nick_index_add(st->pending, acptr); // No-op if a hook already added it
+        }
+    }
+    for (; n < NC_REBUILD_BATCH && st->rebuild_channel_pos < st->rebuild_channel_count; n++) {
+        Channel *channel = find_channel(st->rebuild_channels[st->rebuild_channel_pos++]);
+        if (channel) {
+            chan_index_add(st->pending, channel);
+        }
+    }
+    if (st->rebuild_pos >= st->rebuild_count && st->rebuild_channel_pos >= st->rebuild_channel_count) {
+        nc_rebuild_finish();
+    }
+}
+
+void nc_state_free(ModData *m) {
+    struct nc_state *st = m->ptr;
+
+    if (st) {
+        nick_index_free(st->pending);
+        nick_index_free(st->active);
+        nc_rebuild_clear(st);
+        safe_free(st->collision_queue);
+        safe_free(m->ptr);
+    }
 }
 
+// /STATS nickcollator - show how often the ASCII fast path was taken
+int nickcollator_stats(Client *client, const char *flag) {
+    unsigned long long total = nc_fast_hits + nc_fast_collated + nc_icu_path;
 
+    if (strcasecmp(flag, "nickcollator") || !IsOper(client)) {
+        return 0;
+    }
+
+    sendtxtnumeric(client, "nickcollator: %d nicks and %d channel names indexed",
+                   nc_state->active->count[NC_TABLE_NICKS], nc_state->active->count[NC_TABLE_CHANNELS]);
+    if (nc_state->pending) {
+        sendtxtnumeric(client, "nickcollator: applying new rules, %d/%d users and %d/%d channels re-indexed",
+                       nc_state->rebuild_pos, nc_state->rebuild_count,
+                       nc_state->rebuild_channel_pos, nc_state->rebuild_channel_count);
+    }
+    sendtxtnumeric(client, "nickcollator: %llu collisions outside /NICK (policy %s), %llu renamed, %llu rejected",
+                   nc_collisions, collision_policy_name(muhcfg.collision_policy),
+                   nc_collisions_renamed, nc_collisions_rejected);
+    sendtxtnumeric(client, "nickcollator: %d protected nicks, %llu refused on NICK, %llu renamed on connect",
+                   muhcfg.num_protected, nc_protected_refused, nc_protected_renamed);
+    sendtxtnumeric(client, "nickcollator: reject cache %llu hits, %llu misses; bloom filter %llu definite misses, %llu false positives",
+                   nc_reject_hits, nc_reject_misses, nc_bloom_negatives, nc_bloom_false_positives);
+    sendtxtnumeric(client, "nickcollator: %llu NICK commands checked, %llu refused (%llu could not be canonicalized)",
+                   nc_nick_checks, nc_nick_rejected, nc_nick_uncheckable);
+    sendtxtnumeric(client, "nickcollator: %llu nicks canonicalized", total);
+    sendtxtnumeric(client, "nickcollator: ascii fast path %llu (%.1f%%), fast path + collation %llu (%.1f%%), full ICU path %llu (%.1f%%)",
+                   nc_fast_hits, total ? 100.0 * nc_fast_hits / total : 0.0,
+                   nc_fast_collated, total ? 100.0 * nc_fast_collated / total : 0.0,
+                   nc_icu_path, total ? 100.0 * nc_icu_path / total : 0.0);
+#ifndef NICKCOLLATOR_NO_TIMING
+    for (int i = 0; i < NC_NUM_STAGES; i++) {
+        const struct nc_hist *h = &nc_hist[i];
+
+        sendtxtnumeric(client, "nickcollator: latency %-7s %llu samples, avg %llu ns, p50 < %llu ns, p99 < %llu ns, max < %llu ns",
+                       nc_stage_names[i], h->count, h->count ? h->sum_ns / h->count : 0,
+                       nc_hist_percentile(h, 50), nc_hist_percentile(h, 99), nc_hist_percentile(h, 100));
+    }
+#endif
+    return 1;
+}
 
 // Test function for checking configuration
 int MODNAME_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs) {
@@ -228,6 +1895,47 @@ int MODNAME_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs) {
                              cep->file->filename, cep->line_number, cep->value);
                 errors++;
             }
+        } else if (!strcmp(cep->name, "protect-channels")) {
+            if (BadPtr(cep->value)) {
+                config_error("%s:%i: %s::%s must be yes or no",
+                             cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+        } else if (!strcmp(cep->name, "collision-policy")) {
+            if (BadPtr(cep->value) ||
+                (strcasecmp(cep->value, "log") &&
+                 strcasecmp(cep->value, "rename") &&
+                 strcasecmp(cep->value, "reject"))) {
+                config_error("%s:%i: %s::%s must be one of: log, rename, reject",
+                             cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+        } else if (!strcmp(cep->name, "skeleton-table")) {
+            struct skeleton_table table;
+            char *path = NULL, *errstr = NULL;
+
+            if (BadPtr(cep->value)) {
+                config_error("%s:%i: %s::%s must be the path of a table built by nc_skelgen",
+                             cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+                continue;
+            }
+            safe_strdup(path, cep->value);
+            convert_to_absolute_path(&path, CONFDIR);
+            if (!skeleton_load(&table, path, &errstr)) {
+                config_error("%s:%i: %s::%s: cannot load %s: %s",
+                             cep->file->filename, cep->line_number, MYCONF, cep->name, path, errstr);
+                errors++;
+            }
+            skeleton_unload(&table);
+            safe_free(path);
+        } else if (!strcmp(cep->name, "protected")) {
+            for (cep2 = cep->items; cep2; cep2 = cep2->next) {
+                if (!cep2->name || !strlen(cep2->name)) {
+                    config_error("%s:%i: protected entry must be non-empty", cep2->file->filename, cep2->line_number);
+                    errors++;
+                }
+            }
         } else if (!strcmp(cep->name, "mapping")) {
             muhcfg.got_mapping = 1; // Indicate mappings are present
 
@@ -249,7 +1957,6 @@ int MODNAME_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs) {
 // Function to load mappings from config
 int MODNAME_configrun(ConfigFile *cf, ConfigEntry *ce, int type) {
     ConfigEntry *cep, *cep2;
-    char *token;
 
     if (type != CONFIG_MAIN)
         return 0;
@@ -277,6 +1984,28 @@ int MODNAME_configrun(ConfigFile *cf, ConfigEntry *ce, int type) {
                 return -1;
             }
         }
+        if (!strcmp(cep->name, "protected")) {
+            // "Nick" or "Nick" "account"; canonicalized when the rules are compiled
+            for (cep2 = cep->items; cep2; cep2 = cep2->next) {
+                protected_add(cep2->name, BadPtr(cep2->value) ? NULL : cep2->value);
+            }
+        }
+        if (!strcmp(cep->name, "protect-channels")) {
+            muhcfg.protect_channels = config_checkval(cep->value, CFG_YESNO);
+        }
+        if (!strcmp(cep->name, "collision-policy")) {
+            if (!strcasecmp(cep->value, "log")) {
+                muhcfg.collision_policy = NC_COLLISION_LOG;
+            } else if (!strcasecmp(cep->value, "reject")) {
+                muhcfg.collision_policy = NC_COLLISION_REJECT;
+            } else {
+                muhcfg.collision_policy = NC_COLLISION_RENAME;
+            }
+        }
+        if (!strcmp(cep->name, "skeleton-table")) {
+            safe_strdup(muhcfg.skeleton_file, cep->value);
+            convert_to_absolute_path(&muhcfg.skeleton_file, CONFDIR);
+        }
         if (!strcmp(cep->name, "mapping")) {
             // Process nested entries in "mapping"
             for (cep2 = cep->items; cep2; cep2 = cep2->next) {
@@ -285,36 +2014,14 @@ int MODNAME_configrun(ConfigFile *cf, ConfigEntry *ce, int type) {
                     return -1;
                 }
 
-                // Allocate memory for new mapping group
-                muhcfg.num_mappings++;
-                muhcfg.mappings = realloc(muhcfg.mappings, sizeof(struct mapping) * muhcfg.num_mappings);
-                if (!muhcfg.mappings) {
-                    config_error("Memory allocation error");
-                    return -1; // Error if memory allocation fails
-                }
-
-                struct mapping *current_mapping = &muhcfg.mappings[muhcfg.num_mappings - 1];
-                current_mapping->num_equivalents = 0;
-                current_mapping->equivalents = NULL;
-
-                // Tokenize mapping values (e.g., "A, B")
-                char *mapping_str = strdup(cep2->name); // Use `cep2->name`
-                token = strtok(mapping_str, ", ");
-                while (token) {
-                    current_mapping->num_equivalents++;
-                    current_mapping->equivalents = realloc(current_mapping->equivalents, sizeof(char *) * current_mapping->num_equivalents);
-                    if (!current_mapping->equivalents) {
-                        config_error("Memory allocation error");
-                        safe_free(mapping_str);
-                        return -1;
-                    }
-                    current_mapping->equivalents[current_mapping->num_equivalents - 1] = strdup(token);
-                    token = strtok(NULL, ", ");
+                if (!mapping_add_group(cep2->name)) {
+                    return -1;
                 }
-                safe_free(mapping_str); // Free temporary string
             }
         }
     }
+
+    // The rules are compiled in MOD_LOAD, once all blocks have been read
     return 1;
 }
 
@@ -327,28 +2034,98 @@ MOD_TEST() {
 }
 
 MOD_INIT() {
+    ModDataInfo mreq;
+
     MARK_AS_GLOBAL_MODULE(modinfo); // Mark as global module
     setcfg();                       // Initialize configuration
-    collator_init();                // Initialize ICU collator
+
+    // Indexes and rules in use, kept across REHASH
+    LoadPersistentPointer(modinfo, nc_state, nc_state_free);
+    if (!nc_state) {
+        nc_state = safe_alloc(sizeof(struct nc_state));
+    }
+
+    // Per-client cache of the canonical nick, kept across REHASH
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.type = MODDATATYPE_CLIENT;
+    mreq.name = "nickcollator_cache";
+    mreq.free = nick_cache_md_free;
+    nick_cache_md = ModDataAdd(modinfo->handle, mreq);
+    if (!nick_cache_md) {
+        config_error("[nickcollator] Failed to request nickcollator_cache moddata: %s", ModuleGetErrorStr(modinfo->handle));
+        return MOD_FAILED;
+    }
+
+    // Same for the canonical name of channels, with protect-channels
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.type = MODDATATYPE_CHANNEL;
+    mreq.name = "nickcollator_chancache";
+    mreq.free = nick_cache_md_free;
+    chan_cache_md = ModDataAdd(modinfo->handle, mreq);
+    if (!chan_cache_md) {
+        config_error("[nickcollator] Failed to request nickcollator_chancache moddata: %s", ModuleGetErrorStr(modinfo->handle));
+        return MOD_FAILED;
+    }
+
+    // Hooks keeping the canonical nick index up to date
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_CONNECT, 0, nickcollator_connect);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_CONNECT, 0, nickcollator_connect);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_QUIT, 0, nickcollator_quit);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_QUIT, 0, nickcollator_quit);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_NICKCHANGE, 0, nickcollator_pre_nickchange);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_NICKCHANGE, 0, nickcollator_pre_nickchange);
+    HookAdd(modinfo->handle, HOOKTYPE_POST_LOCAL_NICKCHANGE, 0, nickcollator_post_nickchange);
+    HookAdd(modinfo->handle, HOOKTYPE_POST_REMOTE_NICKCHANGE, 0, nickcollator_post_nickchange);
+    HookAdd(modinfo->handle, HOOKTYPE_CHANNEL_CREATE, 0, nickcollator_channel_create);
+    HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, nickcollator_stats);
     return MOD_SUCCESS;
 }
 
 MOD_LOAD() {
+    struct ruleset *rules;
+
     // Override the /NICK command with our custom function
     if (!CommandOverrideAdd(modinfo->handle, "NICK", 0, override_nick)) {
         return MOD_FAILED;
     }
+    // And /JOIN, for protect-channels
+    if (!CommandOverrideAdd(modinfo->handle, "JOIN", 0, override_join)) {
+        return MOD_FAILED;
+    }
+
+    // Compile the rules into a new rule set. Until the index for it is built,
+    // the index of the previous rules keeps serving NICK checks.
+    rules = ruleset_compile();
+    if (!rules) {
+        if (!nc_state->active) {
+            return MOD_FAILED;
+        }
+        config_warn("[nickcollator] Keeping the previous rules");
+    } else if (!nc_state->active) {
+        // Fresh load: there is nothing to serve from, build the index right away
+        nc_state->active = nick_index_new(rules, 0);
+        nick_index_build(nc_state->active);
+    } else {
+        nc_rebuild_start(rules);
+    }
+
+    EventAdd(modinfo->handle, "nickcollator_collisions", nickcollator_collisions, NULL, 100, 0);
+
+    // (Re)start the rebuild, also when a REHASH interrupted it
+    if (nc_state->pending) {
+        rebuild_event = EventAdd(modinfo->handle, "nickcollator_rebuild", nickcollator_rebuild, NULL, 100, 0);
+    }
     return MOD_SUCCESS;
 }
 
 MOD_UNLOAD() {
-    if (collator != NULL) {
-        ucol_close(collator); // Close ICU collator
-    }
+    SavePersistentPointer(modinfo, nc_state); // The indexes and queued collisions outlive a REHASH
     freecfg();               // Free configuration memory
     return MOD_SUCCESS;
 }
 
+#endif /* NICKCOLLATOR_STANDALONE */
+
 // Additional memory management functions
 void* safe_alloc_nick_memory(size_t size) {
     void *memory = safe_alloc(size);
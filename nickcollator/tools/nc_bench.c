@@ -0,0 +1,496 @@
+/*
+ * nc_bench - standalone benchmark and differential test for NickCollator
+ *
+ * Builds the nickcollator mapping, collation and index core without the IRCd
+ * (see unrealircd.h next to this file), generates a synthetic population of
+ * nicks and measures the cost of one NICK collision check for every
+ * collator_strength. With -d it also compares the verdicts of the index
+ * against brute-force scans of the whole population.
+ *
+ * Build:  make -C nickcollator/tools
+ * Usage:  nc_bench [-n population] [-q queries] [-d diff_queries] [-m mapping_file]
+ *                  [-k skeleton_table] [-g extra_groups] [-x latin,cyrillic,greek,cjk]
+ *                  [-s strengths] [-f flood_variants] [-p protected] [-r seed]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or any later version.
+ */
+
+#define NICKCOLLATOR_STANDALONE
+#include "../nickcollator.c"
+
+#include <time.h>
+#include <unistd.h>
+
+struct list_head client_list = { &client_list, &client_list };
+Channel *channels = NULL;
+
+// Latin, Cyrillic and Greek lookalikes, used when no -m file is given
+static const char *default_mappings[] = {
+    "A, А, Α", "a, а", "B, В, Β", "C, С", "c, с", "E, Е, Ε", "e, е",
+    "H, Н, Η", "I, І, Ι, l, 1", "K, К, Κ", "M, М, Μ", "O, О, Ο, 0",
+    "o, о, ο", "P, Р, Ρ", "p, р", "T, Т, Τ", "X, Х, Χ", "x, х", "y, у",
+    "rn, m", NULL
+};
+
+static const char *strength_names[] = { "off", "primary", "secondary", "tertiary", "quaternary", "identical" };
+static const int strength_values[] = { -1, UCOL_PRIMARY, UCOL_SECONDARY, UCOL_TERTIARY, UCOL_QUATERNARY, UCOL_IDENTICAL };
+#define NUM_STRENGTHS 6
+
+static int script_mix[4] = { 70, 15, 10, 5 }; // Latin, Cyrillic, Greek, CJK
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint32_t rnd(uint32_t n) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state % n);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int put_utf8(char *p, uint32_t cp) {
+    if (cp < 0x80) {
+        p[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        p[0] = 0xc0 | (cp >> 6);
+        p[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    p[0] = 0xe0 | (cp >> 12);
+    p[1] = 0x80 | ((cp >> 6) & 0x3f);
+    p[2] = 0x80 | (cp & 0x3f);
+    return 3;
+}
+
+static uint32_t random_codepoint(int script) {
+    static const char latin[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789[]\\^_{|}-";
+    uint32_t cp;
+
+    switch (script) {
+    case 0:
+        return latin[rnd(sizeof(latin) - 1)];
+    case 1:
+        return 0x0410 + rnd(0x40);          // А..я
+    case 2:
+        do {
+            cp = 0x0391 + rnd(0x39);        // Α..ω
+        } while (cp == 0x03a2 || (cp > 0x03a9 && cp < 0x03b1));
+        return cp;
+    default:
+        return 0x4e00 + rnd(0x5200);        // CJK unified ideographs
+    }
+}
+
+static void random_nick(char *buf, size_t size) {
+    int r = rnd(script_mix[0] + script_mix[1] + script_mix[2] + script_mix[3]);
+    int script = 0, len, i, o = 0;
+
+    while (r >= script_mix[script]) {
+        r -= script_mix[script++];
+    }
+    len = (script == 3 ? 2 : 3) + rnd(script == 3 ? 4 : 10);
+    for (i = 0; i < len && o + 4 < (int)size; i++) {
+        o += put_utf8(buf + o, random_codepoint(script));
+    }
+    buf[o] = '\0';
+}
+
+// Derive a lookalike of 'nick': swap characters for other equivalents of their
+// mapping group, or flip ASCII case, as an impersonator would
+static void lookalike_nick(char *buf, size_t size, const char *nick) {
+    size_t o = 0;
+    const char *p = nick;
+
+    while (*p && o + 8 < size) {
+        int g, e, done = 0;
+
+        if (rnd(3) == 0) {
+            for (g = 0; g < muhcfg.num_mappings && !done; g++) {
+                struct mapping *m = &muhcfg.mappings[g];
+                for (e = 0; e < m->num_equivalents && !done; e++) {
+                    size_t l = strlen(m->equivalents[e]);
+                    if (!strncmp(p, m->equivalents[e], l)) {
+                        const char *rep = m->equivalents[rnd(m->num_equivalents)];
+                        if (o + strlen(rep) + 1 < size) {
+                            strcpy(buf + o, rep);
+                            o += strlen(rep);
+                            p += l;
+                            done = 1;
+                        }
+                    }
+                }
+            }
+        }
+        if (!done) {
+            char c = *p++;
+            if (rnd(4) == 0 && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+                c ^= 0x20;
+            }
+            buf[o++] = c;
+        }
+    }
+    buf[o] = '\0';
+}
+
+static int load_mapping_file(const char *path) {
+    char line[4096];
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        perror(path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line, *q, *c;
+
+        // Accept config style entries: "A, B, C"; // comment
+        if ((c = strstr(p, "//"))) {
+            *c = '\0';
+        }
+        while (*p == ' ' || *p == '\t' || *p == '"') {
+            p++;
+        }
+        for (q = p + strlen(p); q > p && strchr(" \t\r\n\";", q[-1]); q--);
+        *q = '\0';
+        if (*p && !mapping_add_group(p)) {
+            fclose(fp);
+            return 0;
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+// Synthesize extra mapping groups to see how the table size affects the cost
+static void add_random_groups(int count) {
+    char group[64];
+    int i, o;
+
+    for (i = 0; i < count; i++) {
+        o = put_utf8(group, random_codepoint(1 + rnd(3)));
+        o += sprintf(group + o, ", ");
+        o += put_utf8(group + o, random_codepoint(1 + rnd(3)));
+        group[o] = '\0';
+        mapping_add_group(group);
+    }
+}
+
+// The original apply_collator_mapping: every ordered pair of equivalents,
+// converted and substituted in place, in rule order
+static void legacy_apply_mapping(UChar *u_str, int32_t size) {
+    UErrorCode status = U_ZERO_ERROR;
+
+    for (int i = 0; i < muhcfg.num_mappings; i++) {
+        struct mapping *current_mapping = &muhcfg.mappings[i];
+        for (int j = 0; j < current_mapping->num_equivalents; j++) {
+            for (int k = 0; k < current_mapping->num_equivalents; k++) {
+                UChar u_from[10], u_to[10];
+                int32_t from_len, to_len;
+
+                if (j == k) continue;
+                status = U_ZERO_ERROR;
+                u_strFromUTF8(u_from, 10, &from_len, current_mapping->equivalents[j], -1, &status);
+                u_strFromUTF8(u_to, 10, &to_len, current_mapping->equivalents[k], -1, &status);
+                if (U_FAILURE(status) || status == U_STRING_NOT_TERMINATED_WARNING) {
+                    continue;
+                }
+
+                UChar *pos = u_strstr(u_str, u_from);
+                while (pos) {
+                    if (u_strlen(u_str) - from_len + to_len >= size) {
+                        break;
+                    }
+                    u_memmove(pos + to_len, pos + from_len, u_strlen(pos + from_len) + 1);
+                    u_memcpy(pos, u_to, to_len);
+                    pos = u_strstr(pos + to_len, u_from);
+                }
+            }
+        }
+    }
+}
+
+static int legacy_convert(const char *nick, UChar *out, int32_t size) {
+    UErrorCode status = U_ZERO_ERROR;
+
+    u_strFromUTF8(out, size, NULL, nick, -1, &status);
+    if (U_FAILURE(status) || status == U_STRING_NOT_TERMINATED_WARNING) {
+        return 0;
+    }
+    legacy_apply_mapping(out, size);
+    return 1;
+}
+
+static int ustr_equal(const struct ruleset *rs, const UChar *a, const UChar *b) {
+    if (rs->collator) {
+        return ucol_strcoll(rs->collator, a, -1, b, -1) == UCOL_EQUAL;
+    }
+    return u_strcmp(a, b) == 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -n N     population size (default 100000)\n"
+        "  -q N     NICK checks to time per strength (default 200000)\n"
+        "  -d N     queries to verify against brute-force scans (default 0)\n"
+        "  -m FILE  mapping groups, one per line as in the config block\n"
+        "  -k FILE  skeleton table built by nc_skelgen\n"
+        "  -g N     add N random Cyrillic/Greek/CJK mapping groups\n"
+        "  -x L,C,G,J  script mix in percent (default 70,15,10,5)\n"
+        "  -s LIST  strengths to run, e.g. off,primary (default all)\n"
+        "  -f N     flood: queries cycle through N lookalikes of a few existing nicks\n"
+        "  -p N     add N random protected nicks\n"
+        "  -r SEED  random seed\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int population = 100000, queries = 200000, diff_queries = 0, extra_groups = 0, flood_variants = 0;
+    int num_protected = 0;
+    const char *mapping_file = NULL, *skeleton_file = NULL, *strengths = NULL;
+    ModDataInfo md = { 0 };
+    struct ruleset *rs;
+    struct nick_index *idx;
+    int trie_nodes;
+    uint32_t skeleton_entries;
+    Client *clients;
+    char **qnicks;
+    double *lat;
+    int opt, i, si;
+
+    while ((opt = getopt(argc, argv, "n:q:d:m:k:g:x:s:f:p:r:h")) != -1) {
+        switch (opt) {
+        case 'n': population = atoi(optarg); break;
+        case 'q': queries = atoi(optarg); break;
+        case 'd': diff_queries = atoi(optarg); break;
+        case 'm': mapping_file = optarg; break;
+        case 'k': skeleton_file = optarg; break;
+        case 'g': extra_groups = atoi(optarg); break;
+        case 'x':
+            if (sscanf(optarg, "%d,%d,%d,%d", &script_mix[0], &script_mix[1], &script_mix[2], &script_mix[3]) != 4 ||
+                script_mix[0] + script_mix[1] + script_mix[2] + script_mix[3] <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's': strengths = optarg; break;
+        case 'f': flood_variants = atoi(optarg); break;
+        case 'p': num_protected = atoi(optarg); break;
+        case 'r': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (population < 1 || queries < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    srand((unsigned)rng_state);
+
+    setcfg();
+    if (mapping_file) {
+        if (!load_mapping_file(mapping_file)) {
+            return 1;
+        }
+    } else {
+        for (i = 0; default_mappings[i]; i++) {
+            mapping_add_group(default_mappings[i]);
+        }
+    }
+    add_random_groups(extra_groups);
+    for (i = 0; i < num_protected; i++) {
+        char buf[NICKLEN * 4 + 1];
+        random_nick(buf, sizeof(buf));
+        protected_add(buf, NULL);
+    }
+    if (skeleton_file) {
+        muhcfg.skeleton_file = strdup(skeleton_file);
+    }
+    // Compile once up front to report the sizes and catch a bad skeleton table
+    rs = ruleset_compile();
+    if (!rs) {
+        return 1;
+    }
+    trie_nodes = rs->trie.num_nodes;
+    skeleton_entries = rs->skeleton.num_entries;
+    ruleset_free(rs);
+    nick_cache_md = &md;
+
+    // Population, and a query set that is half lookalikes of existing nicks
+    clients = safe_alloc(sizeof(Client) * population);
+    for (i = 0; i < population; i++) {
+        random_nick(clients[i].name, sizeof(clients[i].name));
+        clients[i].is_user = 1;
+        clients[i].client_node.prev = client_list.prev;
+        clients[i].client_node.next = &client_list;
+        client_list.prev->next = &clients[i].client_node;
+        client_list.prev = &clients[i].client_node;
+    }
+    qnicks = safe_alloc(sizeof(char *) * queries);
+    for (i = 0; i < queries; i++) {
+        char buf[NICKLEN * 4 + 1];
+        if (flood_variants > 0 && i >= flood_variants) {
+            // A botnet cycling through the same lookalikes of a few nicks
+            strcpy(buf, qnicks[rnd(flood_variants)]);
+        } else if (flood_variants > 0) {
+            lookalike_nick(buf, sizeof(buf), clients[rnd(population < 10 ? population : 10)].name);
+        } else if (rnd(2)) {
+            lookalike_nick(buf, sizeof(buf), clients[rnd(population)].name);
+        } else {
+            random_nick(buf, sizeof(buf));
+        }
+        qnicks[i] = strdup(buf);
+    }
+    lat = safe_alloc(sizeof(double) * queries);
+
+    printf("population %d, queries %d, mapping groups %d, trie nodes %d, skeleton entries %u, protected %d\n",
+           population, queries, muhcfg.num_mappings, trie_nodes, skeleton_entries, num_protected);
+    printf("%-10s %10s %12s %9s %9s %10s %8s %10s %10s\n", "strength", "build ms", "checks/s",
+           "p50 ns", "p99 ns", "collisions", "fast %", "diff scan", "diff legacy");
+
+    for (si = 0; si < NUM_STRENGTHS; si++) {
+        unsigned long long fast_before, total_before;
+        const struct protected_entry *prot;
+        Client *other;
+        int collisions = 0, diff_scan = 0, diff_legacy = 0;
+        double t0, build_ms, total_ns = 0;
+
+        if (strengths && !strstr(strengths, strength_names[si])) {
+            continue;
+        }
+
+        // Fresh rule set and index, as MOD_LOAD would build them
+        muhcfg.collator_strength = strength_values[si];
+        rs = ruleset_compile();
+        if (!rs) {
+            return 1;
+        }
+        idx = nick_index_new(rs, 0);
+        t0 = now_ns();
+        nick_index_build(idx);
+        build_ms = (now_ns() - t0) / 1e6;
+
+        fast_before = nc_fast_hits + nc_fast_collated;
+        total_before = fast_before + nc_icu_path;
+        for (i = 0; i < queries; i++) {
+            t0 = now_ns();
+            // Like override_nick, a nick that cannot be checked is refused
+            if (nick_index_check(idx, qnicks[i], NULL, &other, &prot) < 0 || other || prot) {
+                collisions++;
+            }
+            lat[i] = now_ns() - t0;
+            total_ns += lat[i];
+        }
+        qsort(lat, queries, sizeof(double), cmp_double);
+
+        // Brute force: compare each query against the whole population, once with
+        // the compiled mappings and ucol_strcoll, once with the original pairwise mapping
+        if (diff_queries > 0) {
+            int n = diff_queries < queries ? diff_queries : queries;
+            UChar (*canon)[NC_CANON_MAX] = safe_alloc(sizeof(*canon) * population);
+            UChar (*legacy)[NC_CANON_MAX] = safe_alloc(sizeof(*legacy) * population);
+            char *valid = safe_alloc(population);
+
+            for (i = 0; i < population; i++) {
+                uint8_t key[NC_KEY_MAX];
+                int32_t len;
+                valid[i] = nick_canonicalize(rs, clients[i].name, canon[i], &len, key, sizeof(key)) >= 0;
+                valid[i] |= legacy_convert(clients[i].name, legacy[i], NC_CANON_MAX) << 1;
+            }
+            for (i = 0; i < n; i++) {
+                UChar qc[NC_CANON_MAX], ql[NC_CANON_MAX];
+                uint8_t key[NC_KEY_MAX];
+                int32_t len;
+                int keylen, fast, scan = 0, leg = 0, j;
+
+                keylen = nick_canonicalize(rs, qnicks[i], qc, &len, key, sizeof(key));
+                fast = keylen >= 0 && nick_index_find(idx, key, keylen, NULL) != NULL;
+                if (nick_index_check(idx, qnicks[i], NULL, &other, NULL) < 0) {
+                    other = NULL;
+                }
+                if (fast != (other != NULL)) {
+                    if (diff_scan++ < 5) {
+                        fprintf(stderr, "[%s] reject cache disagrees with the index: %s\n", strength_names[si], qnicks[i]);
+                    }
+                }
+                for (j = 0; j < population && keylen >= 0 && !scan; j++) {
+                    scan = (valid[j] & 1) && ustr_equal(rs, qc, canon[j]);
+                }
+                if (legacy_convert(qnicks[i], ql, NC_CANON_MAX)) {
+                    for (j = 0; j < population && !leg; j++) {
+                        leg = (valid[j] & 2) && ustr_equal(rs, ql, legacy[j]);
+                    }
+                }
+                if (fast != scan) {
+                    if (diff_scan++ < 5) {
+                        fprintf(stderr, "[%s] index %s, scan %s: %s\n", strength_names[si],
+                                fast ? "collides" : "free", scan ? "collides" : "free", qnicks[i]);
+                    }
+                }
+                if (fast != leg) {
+                    if (diff_legacy++ < 5) {
+                        fprintf(stderr, "[%s] index %s, legacy %s: %s\n", strength_names[si],
+                                fast ? "collides" : "free", leg ? "collides" : "free", qnicks[i]);
+                    }
+                }
+            }
+            safe_free(canon);
+            safe_free(legacy);
+            safe_free(valid);
+        }
+
+        printf("%-10s %10.1f %12.0f %9.0f %9.0f %10d %8.1f", strength_names[si], build_ms,
+               queries / (total_ns / 1e9), lat[queries / 2], lat[(int)(queries * 0.99)], collisions,
+               100.0 * (nc_fast_hits + nc_fast_collated - fast_before) /
+                   (nc_fast_hits + nc_fast_collated + nc_icu_path - total_before));
+        if (diff_queries > 0) {
+            printf(" %10d %10d\n", diff_scan, diff_legacy);
+        } else {
+            printf(" %10s %10s\n", "-", "-");
+        }
+
+        // Drop the entries as quits would, then the index with its rules
+        for (i = 0; i < population; i++) {
+            nick_index_del(idx, &clients[i]);
+        }
+        nick_index_free(idx);
+    }
+
+    printf("reject cache %llu hits, %llu misses; bloom filter %llu definite misses, %llu false positives\n",
+           nc_reject_hits, nc_reject_misses, nc_bloom_negatives, nc_bloom_false_positives);
+#ifndef NICKCOLLATOR_NO_TIMING
+    // Stage latencies over all strengths, index builds included
+    for (i = 0; i < NC_NUM_STAGES; i++) {
+        const struct nc_hist *h = &nc_hist[i];
+        if (h->count) {
+            printf("stage %-8s %10llu samples, avg %5llu ns, p50 < %5llu ns, p99 < %6llu ns\n", nc_stage_names[i],
+                   h->count, h->sum_ns / h->count, nc_hist_percentile(h, 50), nc_hist_percentile(h, 99));
+        }
+    }
+#endif
+
+    for (i = 0; i < population; i++) {
+        nick_cache_md_free(&moddata_client(&clients[i], nick_cache_md));
+    }
+    freecfg();
+    for (i = 0; i < queries; i++) {
+        free(qnicks[i]);
+    }
+    safe_free(qnicks);
+    safe_free(lat);
+    safe_free(clients);
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * nc_skelgen - build the NickCollator skeleton table from confusables.txt
+ *
+ * Reads Unicode's confusables.txt (https://www.unicode.org/Public/security/latest/confusables.txt)
+ * and writes the binary table loaded by the nickcollator::skeleton-table option:
+ * a header, the entries sorted by code point and a pool with the UTF-16
+ * prototypes. The module only mmaps this file, nothing is parsed at startup.
+ *
+ * The table is written in the byte order of this host, so generate it on
+ * (a host of the same architecture as) the IRCd server.
+ *
+ * Build:  make -C nickcollator/tools
+ * Usage:  nc_skelgen confusables.txt confusables.bin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or any later version.
+ */
+
+#define NICKCOLLATOR_STANDALONE
+#include "../nickcollator.c"
+
+#include <ctype.h>
+
+struct list_head client_list = { &client_list, &client_list };
+
+// Entry while building, with its prototype still in a private buffer
+struct gen_entry {
+    uint32_t codepoint;
+    UChar proto[NC_CANON_MAX];
+    int32_t length;
+};
+
+static int gen_entry_cmp(const void *a, const void *b) {
+    const struct gen_entry *ea = a, *eb = b;
+    return ea->codepoint < eb->codepoint ? -1 : ea->codepoint > eb->codepoint;
+}
+
+// Parse "0021 ;\t01C3 ;\tMA\t# ..." into an entry. Returns 0 for lines to skip.
+static int parse_line(char *line, struct gen_entry *e, int lineno) {
+    char *src, *dst, *p, *end;
+
+    if ((p = strchr(line, '#'))) {
+        *p = '\0';
+    }
+    src = strtok(line, ";");
+    dst = strtok(NULL, ";");
+    if (!src || !dst) {
+        return 0;
+    }
+
+    e->codepoint = strtoul(src, &end, 16);
+    if (end == src || e->codepoint > 0x10ffff) {
+        fprintf(stderr, "line %d: bad source code point\n", lineno);
+        return 0;
+    }
+
+    e->length = 0;
+    for (p = dst; *p; ) {
+        uint32_t cp;
+
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        cp = strtoul(p, &end, 16);
+        if (end == p || cp > 0x10ffff || e->length + 2 >= NC_CANON_MAX) {
+            fprintf(stderr, "line %d: bad or too long prototype\n", lineno);
+            return 0;
+        }
+        U16_APPEND_UNSAFE(e->proto, e->length, cp);
+        p = end;
+    }
+    return e->length > 0;
+}
+
+int main(int argc, char **argv) {
+    struct skeleton_header hdr;
+    struct skeleton_table check;
+    struct gen_entry *entries = NULL;
+    int num_entries = 0, alloc = 0, lineno = 0, i;
+    uint32_t pool_units = 0;
+    char line[1024], tmpname[4096], *errstr;
+    FILE *in, *out;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s confusables.txt output.bin\n", argv[0]);
+        return 1;
+    }
+
+    if (!(in = fopen(argv[1], "r"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        char *p = line;
+
+        lineno++;
+        if (lineno == 1 && !strncmp(p, "\xef\xbb\xbf", 3)) {
+            p += 3; // UTF-8 BOM
+        }
+        if (num_entries == alloc) {
+            alloc = alloc ? alloc * 2 : 8192;
+            entries = realloc(entries, sizeof(struct gen_entry) * alloc);
+            if (!entries) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        if (parse_line(p, &entries[num_entries], lineno)) {
+            pool_units += entries[num_entries].length;
+            num_entries++;
+        }
+    }
+    fclose(in);
+
+    qsort(entries, num_entries, sizeof(struct gen_entry), gen_entry_cmp);
+    for (i = 1; i < num_entries; i++) {
+        if (entries[i].codepoint == entries[i - 1].codepoint) {
+            fprintf(stderr, "duplicate source code point %04X\n", entries[i].codepoint);
+            return 1;
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, NC_SKELETON_MAGIC, sizeof(hdr.magic));
+    hdr.version = NC_SKELETON_VERSION;
+    hdr.byte_order = NC_SKELETON_BYTE_ORDER;
+    hdr.num_entries = num_entries;
+    hdr.entries_offset = sizeof(hdr);
+    hdr.pool_units = pool_units;
+    hdr.pool_offset = hdr.entries_offset + num_entries * sizeof(struct skeleton_entry);
+
+    // Write next to the target and rename, the IRCd may have the old file mapped
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", argv[2]);
+    if (!(out = fopen(tmpname, "wb"))) {
+        perror(tmpname);
+        return 1;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    pool_units = 0;
+    for (i = 0; i < num_entries; i++) {
+        struct skeleton_entry se = { entries[i].codepoint, pool_units, entries[i].length };
+        fwrite(&se, sizeof(se), 1, out);
+        pool_units += entries[i].length;
+    }
+    for (i = 0; i < num_entries; i++) {
+        fwrite(entries[i].proto, sizeof(UChar), entries[i].length, out);
+    }
+    if (fclose(out) != 0) {
+        perror(tmpname);
+        return 1;
+    }
+
+    // Make sure the module will accept what we wrote
+    if (!skeleton_load(&check, tmpname, &errstr)) {
+        fprintf(stderr, "%s: verification failed: %s\n", tmpname, errstr);
+        unlink(tmpname);
+        return 1;
+    }
+    skeleton_unload(&check);
+    if (rename(tmpname, argv[2]) < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    printf("%s: %d entries, %u pool code units, %zu bytes\n", argv[2], num_entries, pool_units,
+           (size_t)hdr.pool_offset + pool_units * sizeof(UChar));
+    free(entries);
+    return 0;
+}
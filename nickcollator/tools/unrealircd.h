@@ -0,0 +1,154 @@
+/*
+ * Minimal stand-in for the UnrealIRCd headers, providing just the symbols the
+ * nickcollator core uses so it can be built outside the IRCd with
+ * NICKCOLLATOR_STANDALONE (see nc_bench.c). Not used for the module itself.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or any later version.
+ */
+
+#ifndef NICKCOLLATOR_STUB_UNREALIRCD_H
+#define NICKCOLLATOR_STUB_UNREALIRCD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define NICKLEN 30
+#define CHANNELLEN 32
+#define SIPHASH_KEY_LENGTH 16
+#define STUB_MODDATA_SLOTS 4
+
+typedef struct ModData {
+    void *ptr;
+    int i;
+} ModData;
+
+typedef struct ModDataInfo {
+    int slot;
+} ModDataInfo;
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+typedef struct Client {
+    struct list_head client_node;
+    char name[NICKLEN + 1];
+    int is_user;
+    ModData moddata[STUB_MODDATA_SLOTS];
+} Client;
+
+extern struct list_head client_list;
+
+typedef struct Channel {
+    struct Channel *nextch;
+    char name[CHANNELLEN + 1];
+    ModData moddata[STUB_MODDATA_SLOTS];
+} Channel;
+
+extern Channel *channels;
+
+#define IsUser(x) ((x)->is_user)
+#define moddata_client(client, md) ((client)->moddata[(md)->slot])
+#define moddata_channel(channel, md) ((channel)->moddata[(md)->slot])
+
+#define list_for_each_entry(pos, head, member) \
+    for (pos = (void *)((char *)(head)->next - offsetof(__typeof__(*pos), member)); \
+         &pos->member != (head); \
+         pos = (void *)((char *)pos->member.next - offsetof(__typeof__(*pos), member)))
+
+static inline void *safe_alloc(size_t size) {
+    void *p = calloc(1, size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+#define safe_free(x) do { free(x); (x) = NULL; } while (0)
+
+static inline void config_error(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fputs("[error] ", stderr);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+static inline void config_warn(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fputs("[warning] ", stderr);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+// SipHash-2-4, as used by the IRCd for its own hash tables
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+    v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+} while (0)
+
+static inline uint64_t siphash_raw(const char *in, size_t len, const char *k) {
+    uint64_t k0, k1, m, b = ((uint64_t)len) << 56;
+    uint64_t v0 = 0x736f6d6570736575ULL, v1 = 0x646f72616e646f6dULL;
+    uint64_t v2 = 0x6c7967656e657261ULL, v3 = 0x7465646279746573ULL;
+    const uint8_t *p = (const uint8_t *)in;
+    size_t i, left = len & 7;
+
+    memcpy(&k0, k, 8);
+    memcpy(&k1, k + 8, 8);
+    v0 ^= k0; v1 ^= k1; v2 ^= k0; v3 ^= k1;
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&m, p + i, 8);
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    for (m = 0; left; left--) {
+        m |= ((uint64_t)p[i + left - 1]) << (8 * (left - 1));
+    }
+    b |= m;
+    v3 ^= b;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static inline uint64_t siphash(const char *in, const char *k) {
+    return siphash_raw(in, strlen(in), k);
+}
+
+static inline void siphash_generate_key(char *k) {
+    int i;
+    for (i = 0; i < SIPHASH_KEY_LENGTH; i++) {
+        k[i] = (char)(rand() & 0xff);
+    }
+}
+
+#endif
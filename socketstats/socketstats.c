@@ -30,13 +30,19 @@ module
 #include "unrealircd.h"
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <stdio.h>
+#include <limits.h>
+#include <math.h>
 #include <sys/sysinfo.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
 #include <ifaddrs.h>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #ifndef TOPICLEN
 #define TOPICLEN MAXTOPICLEN
@@ -48,21 +54,511 @@ module
 #define MESSAGE_SENDTYPE SendType
 #endif
 
-#define CHANNEL_MESSAGE_COUNT(channel) moddata_channel(channel, message_count_md).i
+/*
+ * Output buffer and streaming JSON writer.
+ *
+ * Responses are written straight into a growable buffer instead of being
+ * built as a jansson tree first. The buffer of a released snapshot is kept
+ * and reused by the next render, so a render normally allocates nothing.
+ *
+ * SOCKETSTATS_STANDALONE builds only this part, without the IRCd glue, for
+ * the benchmark in tools/.
+ */
+
+struct stats_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static void stats_buf_grow(struct stats_buf *b, size_t need) {
+    size_t size = b->size ? b->size : 4096;
+    char *data;
+
+    while (size < b->len + need)
+        size *= 2;
+    data = safe_alloc(size);
+    if (b->len)
+        memcpy(data, b->data, b->len);
+    safe_free(b->data);
+    b->data = data;
+    b->size = size;
+}
+
+static inline void stats_buf_reserve(struct stats_buf *b, size_t need) {
+    if (b->len + need > b->size)
+        stats_buf_grow(b, need);
+}
+
+static inline void stats_buf_add(struct stats_buf *b, const char *s, size_t len) {
+    stats_buf_reserve(b, len);
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+}
+
+static inline void stats_buf_addc(struct stats_buf *b, char c) {
+    stats_buf_reserve(b, 1);
+    b->data[b->len++] = c;
+}
+
+#define stats_buf_addstr(b, s) stats_buf_add(b, s, sizeof(s) - 1)
+
+static void stats_buf_addint(struct stats_buf *b, long long v) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        *--p = '-';
+    stats_buf_add(b, p, tmp + sizeof(tmp) - p);
+}
+
+// What a byte turns into inside a JSON string: 0 is copied as is, 'u' is
+// written as \u00XX, '8' starts a UTF-8 sequence to be validated, anything
+// else is the character following the backslash
+static const char json_escape_table[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8',
+    '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8',
+    '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8',
+    '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8',
+    '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8',
+    '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8',
+    '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8',
+    '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8', '8',
+};
+
+// Length of the valid UTF-8 sequence at 's' (at most 'left' bytes), or 0 if
+// it is invalid: overlong forms, surrogates and code points past U+10FFFF
+static int json_utf8_len(const unsigned char *s, size_t left) {
+    unsigned char c = s[0];
+    int len, i;
+
+    if (c >= 0xC2 && c <= 0xDF)
+        len = 2;
+    else if (c >= 0xE0 && c <= 0xEF)
+        len = 3;
+    else if (c >= 0xF0 && c <= 0xF4)
+        len = 4;
+    else
+        return 0;
+    if ((size_t)len > left)
+        return 0;
+    for (i = 1; i < len; i++) {
+        if ((s[i] & 0xC0) != 0x80)
+            return 0;
+    }
+    if ((c == 0xE0 && s[1] < 0xA0) || (c == 0xED && s[1] > 0x9F) ||
+        (c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] > 0x8F))
+        return 0;
+    return len;
+}
+
+// Write a quoted JSON string. Like json_string_unreal(), invalid UTF-8 does
+// not make the output invalid: each offending byte is replaced with '?'.
+static void stats_buf_addjson(struct stats_buf *b, const char *str) {
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *s = (const unsigned char *)str;
+    const unsigned char *run;
+    size_t left = strlen(str);
+
+    stats_buf_reserve(b, left + 2);
+    b->data[b->len++] = '"';
+    while (left) {
+        // Copy the longest stretch that needs no escaping in one go
+        for (run = s; left && !json_escape_table[*s]; s++, left--);
+        if (s > run)
+            stats_buf_add(b, (const char *)run, s - run);
+        if (!left)
+            break;
+
+        char e = json_escape_table[*s];
+        if (e == '8') {
+            int len = json_utf8_len(s, left);
+            if (len) {
+                stats_buf_add(b, (const char *)s, len);
+                s += len;
+                left -= len;
+            } else {
+                stats_buf_addc(b, '?');
+                s++;
+                left--;
+            }
+        } else if (e == 'u') {
+            char u[6] = { '\\', 'u', '0', '0', hex[*s >> 4], hex[*s & 15] };
+            stats_buf_add(b, u, 6);
+            s++;
+            left--;
+        } else {
+            char esc[2] = { '\\', e };
+            stats_buf_add(b, esc, 2);
+            s++;
+            left--;
+        }
+    }
+    stats_buf_addc(b, '"');
+}
+
+#define JSON_MAX_DEPTH 16
+
+// Keeps track of where commas go, so callers only emit keys and values
+struct json_writer {
+    struct stats_buf *buf;
+    int depth;
+    int after_key;
+    unsigned char comma[JSON_MAX_DEPTH];
+};
+
+static void jw_init(struct json_writer *w, struct stats_buf *buf) {
+    memset(w, 0, sizeof(*w));
+    w->buf = buf;
+}
+
+static inline void jw_value(struct json_writer *w) {
+    if (w->after_key) {
+        w->after_key = 0;
+        return;
+    }
+    if (w->comma[w->depth])
+        stats_buf_addc(w->buf, ',');
+    w->comma[w->depth] = 1;
+}
+
+// 'key' is a literal from our own code and is not escaped
+static inline void jw_key(struct json_writer *w, const char *key) {
+    jw_value(w);
+    stats_buf_addc(w->buf, '"');
+    stats_buf_add(w->buf, key, strlen(key));
+    stats_buf_add(w->buf, "\":", 2);
+    w->after_key = 1;
+}
+
+static inline void jw_open(struct json_writer *w, char c) {
+    jw_value(w);
+    stats_buf_addc(w->buf, c);
+    w->comma[++w->depth] = 0;
+}
+
+static inline void jw_close(struct json_writer *w, char c) {
+    w->depth--;
+    stats_buf_addc(w->buf, c);
+}
+
+#define jw_object_open(w) jw_open(w, '{')
+#define jw_object_close(w) jw_close(w, '}')
+#define jw_array_open(w) jw_open(w, '[')
+#define jw_array_close(w) jw_close(w, ']')
+
+static inline void jw_str(struct json_writer *w, const char *s) {
+    jw_value(w);
+    stats_buf_addjson(w->buf, s);
+}
+
+static inline void jw_int(struct json_writer *w, long long v) {
+    jw_value(w);
+    stats_buf_addint(w->buf, v);
+}
+
+static inline void jw_null(struct json_writer *w) {
+    jw_value(w);
+    stats_buf_addstr(w->buf, "null");
+}
+
+static inline void jw_bool(struct json_writer *w, int v) {
+    jw_value(w);
+    if (v)
+        stats_buf_addstr(w->buf, "true");
+    else
+        stats_buf_addstr(w->buf, "false");
+}
+
+// Same format as jansson: %.17g, with ".0" added to whole numbers
+static void jw_double(struct json_writer *w, double v) {
+    char tmp[32];
+    int len;
+
+    jw_value(w);
+    if (v != v || v - v != 0) { // NaN or infinite, no JSON for those
+        stats_buf_addstr(w->buf, "null");
+        return;
+    }
+    len = snprintf(tmp, sizeof(tmp) - 2, "%.17g", v);
+    if (!strpbrk(tmp, ".eE")) {
+        tmp[len++] = '.';
+        tmp[len++] = '0';
+    }
+    stats_buf_add(w->buf, tmp, len);
+}
+
+#define jw_key_str(w, k, v) do { jw_key(w, k); jw_str(w, v); } while (0)
+#define jw_key_int(w, k, v) do { jw_key(w, k); jw_int(w, v); } while (0)
+#define jw_key_bool(w, k, v) do { jw_key(w, k); jw_bool(w, v); } while (0)
+#define jw_key_double(w, k, v) do { jw_key(w, k); jw_double(w, v); } while (0)
+
+// Fields of a channel entry, selectable with /channels?fields=
+#define CHANNEL_FIELD_NAME      0x1
+#define CHANNEL_FIELD_USERS     0x2
+#define CHANNEL_FIELD_MESSAGES  0x4
+#define CHANNEL_FIELD_TOPIC     0x8
+#define CHANNEL_FIELDS_ALL      0xf
+
+// One entry of the "chan" array
+static void stats_json_channel(struct json_writer *w, int fields, const char *name, int users, long long messages, const char *topic) {
+    jw_object_open(w);
+    if (fields & CHANNEL_FIELD_NAME)
+        jw_key_str(w, "name", name);
+    if (fields & CHANNEL_FIELD_USERS)
+        jw_key_int(w, "users", users);
+    if (fields & CHANNEL_FIELD_MESSAGES)
+        jw_key_int(w, "messages", messages);
+    if ((fields & CHANNEL_FIELD_TOPIC) && topic)
+        jw_key_str(w, "topic", topic);
+    jw_object_close(w);
+}
+
+/*
+ * OpenMetrics text exposition for /metrics, written into the same buffers.
+ * Samples of one family must follow its "# TYPE" line without anything in
+ * between, and the whole exposition ends with "# EOF".
+ */
+
+static void om_family(struct stats_buf *b, const char *name, const char *type, const char *help) {
+    stats_buf_addstr(b, "# TYPE ");
+    stats_buf_add(b, name, strlen(name));
+    stats_buf_addc(b, ' ');
+    stats_buf_add(b, type, strlen(type));
+    stats_buf_addstr(b, "\n# HELP ");
+    stats_buf_add(b, name, strlen(name));
+    stats_buf_addc(b, ' ');
+    stats_buf_add(b, help, strlen(help));
+    stats_buf_addc(b, '\n');
+}
+
+// A label value: backslash, double quote and newline are escaped, and like in
+// JSON strings invalid UTF-8 bytes are replaced with '?'
+static void om_label_value(struct stats_buf *b, const char *str) {
+    const unsigned char *s = (const unsigned char *)str;
+    size_t left = strlen(str);
+
+    stats_buf_reserve(b, left + 2);
+    stats_buf_addc(b, '"');
+    while (left) {
+        int len = 1;
+
+        if (*s == '\\' || *s == '"') {
+            char esc[2] = { '\\', *s };
+            stats_buf_add(b, esc, 2);
+        } else if (*s == '\n') {
+            stats_buf_addstr(b, "\\n");
+        } else if (*s < 0x80) {
+            stats_buf_addc(b, *s);
+        } else if ((len = json_utf8_len(s, left))) {
+            stats_buf_add(b, (const char *)s, len);
+        } else {
+            stats_buf_addc(b, '?');
+            len = 1;
+        }
+        s += len;
+        left -= len;
+    }
+    stats_buf_addc(b, '"');
+}
+
+// The start of a sample line: the name and, if 'label' is set, its one label
+static void om_sample(struct stats_buf *b, const char *name, const char *label, const char *value) {
+    stats_buf_add(b, name, strlen(name));
+    if (label) {
+        stats_buf_addc(b, '{');
+        stats_buf_add(b, label, strlen(label));
+        stats_buf_addc(b, '=');
+        om_label_value(b, value);
+        stats_buf_addc(b, '}');
+    }
+    stats_buf_addc(b, ' ');
+}
+
+static void om_int(struct stats_buf *b, const char *name, const char *label, const char *value, long long v) {
+    om_sample(b, name, label, value);
+    stats_buf_addint(b, v);
+    stats_buf_addc(b, '\n');
+}
+
+static void om_double(struct stats_buf *b, const char *name, const char *label, const char *value, double v) {
+    char tmp[32];
+
+    om_sample(b, name, label, value);
+    // OpenMetrics spells the non-finite values its own way. %.17g is enough
+    // digits for any double to parse back to the same value.
+    if (isnan(v))
+        stats_buf_addstr(b, "NaN");
+    else if (isinf(v))
+        stats_buf_addstr(b, v > 0 ? "+Inf" : "-Inf");
+    else
+        stats_buf_add(b, tmp, snprintf(tmp, sizeof(tmp), "%.17g", v));
+    stats_buf_addc(b, '\n');
+}
+
+#ifndef SOCKETSTATS_STANDALONE
+
+#define CHANNEL_RATE_SECONDS 60
+
+// Per-channel ModData
+struct channel_stats {
+    Channel *channel;
+    long long messages;
+    struct channel_stats *dirty_prev, *dirty_next;
+    unsigned char dirty;        // on the dirty list, changed since the last delta
+    unsigned char was_public;   // public as of the last delta, so its removal is announced
+    int top_slot;               // index in top_channels, or -1
+    time_t rate_time;           // the second counted in rate[rate_time % CHANNEL_RATE_SECONDS]
+    unsigned short rate[CHANNEL_RATE_SECONDS]; // messages per second, saturating
+};
 
-int counter;
+#define CHANNEL_STATS(channel) ((struct channel_stats *)moddata_channel(channel, channel_stats_md).ptr)
+#define CHANNEL_MESSAGE_COUNT(channel) (CHANNEL_STATS(channel) ? CHANNEL_STATS(channel)->messages : 0)
+
+long long counter;
 time_t init_time;
 
-int stats_socket;
-char send_buf[4096];
+int stats_socket = -1;
 struct sockaddr_un stats_addr;
-ModDataInfo *message_count_md;
+ModDataInfo *channel_stats_md;
+
+#define STATS_REQUEST_MAX 4096
+
+#define STATS_CACHE_SLOTS 8
+
+enum { ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_DEFLATE, ENCODINGS };
+
+static const char *encoding_names[ENCODINGS] = { "identity", "gzip", "deflate" };
+
+#define COMPRESS_MIN_SIZE 1024  // smaller bodies are sent as they are
+#define COMPRESS_LEVEL 1        // JSON shrinks well even at the fastest level
+
+// A compressed copy of a snapshot's body, made the first time it is asked for
+struct stats_encoded {
+    int tried;
+    struct stats_buf buf;   // empty if compression did not help
+    char etag[32];          // each representation has its own tag
+};
+
+// A rendered response body. It is immutable once rendered and shared by
+// every reader that asks for the same target within cache-max-age.
+struct stats_snapshot {
+    int refcount;
+    uint64_t generation;
+    long long created;  // monotonic ms
+    char *target;       // request target it was rendered for, e.g. "/channels?limit=10"
+    char etag[24];
+    const char *content_type;
+    int pending;        // still being serialized on the worker thread
+    struct stats_buf buf;
+    char *data;         // buf.data and buf.len
+    size_t len;
+    struct stats_encoded encoded[ENCODINGS];
+};
+
+// A reader connected to the stats socket, with its request and pending response
+struct stats_client {
+    struct stats_client *prev, *next;
+    int fd;
+    long long since;    // monotonic ms, when the request or response began
+    char inbuf[STATS_REQUEST_MAX];
+    size_t inlen;
+    size_t request_len; // of the request being answered, pipelined ones follow it
+    int requests;       // answered on this connection so far
+    int keep_alive;     // wait for another request once this one is answered
+    int http10;         // an HTTP/1.0 request, which has to ask for keep-alive
+    int responding;
+    int head;           // a HEAD request, answered without the body
+    int encoding;       // ENCODING_*, the best the reader accepts
+    char if_none_match[32]; // tag the reader already has, if any
+    int waiting;        // for 'snapshot' to come back from the worker thread
+    char header[384];
+    size_t header_len;
+    struct stats_snapshot *snapshot; // body, or NULL for responses without one
+    const char *body;   // in 'snapshot', in the encoding sent
+    size_t body_len;
+    size_t pos;         // bytes of header + body written so far
+    int stream;         // STREAM_*, a subscriber kept open for deltas
+    struct stats_buf out; // stream events not yet written
+    size_t out_pos;
+};
+
+enum { STREAM_NONE, STREAM_NDJSON, STREAM_SSE };
+
+static struct stats_client *stats_clients = NULL;
+static struct stats_snapshot *snapshot_cache[STATS_CACHE_SLOTS];
+static struct stats_buf spare_buf;  // buffer kept from the last freed snapshot
+static char etag_key[SIPHASH_KEY_LENGTH];
+static struct render_job *render_job = NULL; // serializing on the worker thread
+static pthread_t render_thread;
+static int render_pipe[2] = { -1, -1 };     // the worker signals completion on it
+static int num_stats_clients = 0;
+
+// Delta stream state. While there are subscribers, hooks put every channel
+// whose published fields change on the dirty list, and the stream event sends
+// just those, plus whatever global values differ from the last delta.
+static int stream_subscribers = 0;
+static struct channel_stats *dirty_channels = NULL;
+static char **gone_channels = NULL;    // public channels destroyed since the last delta
+static int num_gone_channels = 0, gone_channels_size = 0;
+static struct stats_buf delta_buf;
+static struct {
+    int clients, channels, operators, servers;
+    long long messages;
+} stream_last;
+static struct stream_server {
+    char name[HOSTLEN+1];
+    long users;
+    int seen;
+} *stream_servers = NULL;
+static int num_stream_servers = 0;
+
+// Space-Saving sketch of the busiest channels: a min-heap of at most
+// top-channels entries by a message count that is halved every
+// TOP_HALF_LIFE seconds, so it follows the recent rate
+#define TOP_HALF_LIFE 30
+static struct top_entry {
+    struct channel_stats *stats;
+    long long count;
+} *top_channels = NULL;
+static int num_top_channels = 0;
+static time_t top_decayed = 0;
 
 int socketstats_msg(Client *sptr, Channel *chptr, MessageTag **mtags, const char *msg, MESSAGE_SENDTYPE sendtype);
 
-EVENT(socketstats_socket_evt);
-char *json_escape(char *d, const char *a);
-void md_free(ModData *md);
+EVENT(socketstats_timeout_evt);
+static void socketstats_accept(int listenfd, int revents, void *data);
+static void stats_client_free(struct stats_client *sc);
+static void stats_snapshot_release(struct stats_snapshot *snap);
+void channel_stats_free(ModData *md);
+void host_state_free(ModData *m);
+EVENT(socketstats_stream_evt);
+static void stream_reset(void);
+static struct stats_snapshot *render_job_join(void);
+static void render_job_done(int fd, int revents, void *data);
+int socketstats_channel_create(Channel *channel);
+int socketstats_join(Client *client, Channel *channel, MessageTag *mtags);
+int socketstats_part(Client *client, Channel *channel, MessageTag *mtags, const char *comment);
+int socketstats_kick(Client *client, Client *victim, Channel *channel, MessageTag *mtags, const char *comment);
+int socketstats_quit(Client *client, MessageTag *mtags, const char *comment);
+int socketstats_connect(Client *client);
+int socketstats_pre_nickchange(Client *client, MessageTag *mtags, const char *newnick);
+int socketstats_post_nickchange(Client *client, MessageTag *mtags, const char *oldnick);
+int socketstats_topic(Client *client, Channel *channel, MessageTag *mtags, const char *topic);
+int socketstats_chanmode(Client *client, Channel *channel, MessageTag *mtags, const char *modebuf, const char *parabuf, time_t sendts, int samode);
 int socketstats_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs);
 int socketstats_configposttest(int *errs);
 int socketstats_configrun(ConfigFile *cf, ConfigEntry *ce, int type);
@@ -70,86 +566,281 @@ int socketstats_configrun(ConfigFile *cf, ConfigEntry *ce, int type);
 // config file stuff
 static char *socket_path;
 int socket_hpath = 0;
-static char **selected_nicks = NULL;
-static int num_nicks = 0;
+static int max_connections = 32;
+static long max_sendq = 16*1024*1024;
+static long send_timeout = 30;
+static long cache_max_age = 1000;
+static long request_timeout = 500;
+static long stream_interval = 1000;
+static int top_channels_size = 50;
+static long sample_interval = 5000;
+static int metrics_max_channels = 100;
+static int render_thread_channels = 5000;
+static char *shm_path = NULL;
+static long shm_interval = 1000;
+static char *history_path = NULL;
+static long history_size = 64*1024*1024;
+static long history_interval = 60;
+int socket_hnicks = 0;
+
+// A nick from the nicks option. Its presence is kept up to date by the
+// connect, nick change and quit hooks, so requests never look users up.
+struct watched_nick {
+    char *nick;
+    unsigned char online;
+    unsigned char reported;     // online as of the last delta
+    unsigned char queued;       // in watched_changes
+    time_t since;               // when it came online or went offline, 0 if not seen since the module was loaded
+};
 
-static void parse_nick_list(const char *nicks_str) {
-    char *nicks_copy, *nick, *saveptr;
-    nicks_copy = strdup(nicks_str);
+static struct watched_nick *watched_nicks = NULL;
+static int num_nicks = 0, watched_nicks_size = 0;
+static int *watched_hash = NULL;        // index + 1 of each nick by hash, linear probing
+static unsigned int watched_hash_size = 0;
+static char watched_hash_key[SIPHASH_KEY_LENGTH];
+static int *watched_changes = NULL;     // nicks that came online or went offline since the last delta
+static int num_watched_changes = 0;
+
+static uint64_t watched_hash_nick(const char *nick) {
+    char lower[NICKLEN + 1];
+    size_t i;
+
+    for (i = 0; nick[i] && i < NICKLEN; i++)
+        lower[i] = tolower((unsigned char)nick[i]);
+    return siphash_raw(lower, i, watched_hash_key);
+}
 
-    num_nicks = 1;
-    for (char *c = nicks_copy; *c; c++) {
-        if (*c == ',') {
-            num_nicks++;
-        }
+static struct watched_nick *watched_find(const char *nick) {
+    unsigned int i;
+
+    if (!watched_hash_size)
+        return NULL;
+    for (i = watched_hash_nick(nick) & (watched_hash_size - 1); watched_hash[i]; i = (i + 1) & (watched_hash_size - 1)) {
+        if (!strcasecmp(watched_nicks[watched_hash[i] - 1].nick, nick))
+            return &watched_nicks[watched_hash[i] - 1];
+    }
+    return NULL;
+}
+
+static void watched_hash_insert(int n) {
+    unsigned int i;
+
+    for (i = watched_hash_nick(watched_nicks[n].nick) & (watched_hash_size - 1); watched_hash[i]; i = (i + 1) & (watched_hash_size - 1));
+    watched_hash[i] = n + 1;
+}
+
+// Rebuild the hash at twice the number of nicks or more
+static void watched_rehash(void) {
+    unsigned int size = 64;
+
+    while (size < 2 * (unsigned int)num_nicks)
+        size *= 2;
+    if (!watched_hash_size)
+        siphash_generate_key(watched_hash_key);
+    safe_free(watched_hash);
+    watched_hash = safe_alloc(sizeof(int) * size);
+    watched_hash_size = size;
+    for (int n = 0; n < num_nicks; n++)
+        watched_hash_insert(n);
+}
+
+static void watched_add(const char *nick) {
+    if (!*nick || watched_find(nick))
+        return;
+    if (num_nicks == watched_nicks_size) {
+        struct watched_nick *bigger;
+        watched_nicks_size = watched_nicks_size ? watched_nicks_size * 2 : 16;
+        bigger = safe_alloc(sizeof(struct watched_nick) * watched_nicks_size);
+        if (num_nicks)
+            memcpy(bigger, watched_nicks, sizeof(struct watched_nick) * num_nicks);
+        safe_free(watched_nicks);
+        watched_nicks = bigger;
     }
+    watched_nicks[num_nicks++].nick = strdup(nick);
+    if (2 * (unsigned int)num_nicks > watched_hash_size)
+        watched_rehash();
+    else
+        watched_hash_insert(num_nicks - 1);
+}
 
-    selected_nicks = safe_alloc(sizeof(char *) * num_nicks);
+// Add the nicks of a "nick1, nick2" list, skipping duplicates
+static void parse_nick_list(const char *nicks_str) {
+    char *nicks_copy, *nick, *end, *saveptr;
+    nicks_copy = strdup(nicks_str);
 
-    int i = 0;
-    nick = strtok_r(nicks_copy, ",", &saveptr);
-    while (nick != NULL && i < num_nicks) {
+    for (nick = strtok_r(nicks_copy, ",", &saveptr); nick; nick = strtok_r(NULL, ",", &saveptr)) {
         while (*nick == ' ') nick++;
-        selected_nicks[i++] = strdup(nick);
-        nick = strtok_r(NULL, ",", &saveptr);
+        for (end = nick + strlen(nick); end > nick && end[-1] == ' '; end--);
+        *end = '\0';
+        watched_add(nick);
     }
 
     free(nicks_copy);
 }
 
-void get_cpu_info(double *total_usage, json_t *core_obj) {
-    static unsigned long long prev_total[129] = {0}, prev_idle[129] = {0}; 
-    FILE *fp = fopen("/proc/stat", "r");
-    if (!fp) {
-        *total_usage = 0.0;
+// A watched nick may have come online or gone offline
+static void watched_set(const char *nick, int online) {
+    struct watched_nick *e;
+
+    if (!num_nicks || !(e = watched_find(nick)) || e->online == online)
         return;
+    e->online = online;
+    e->since = TStime();
+    if (stream_subscribers && !e->queued) {
+        e->queued = 1;
+        watched_changes[num_watched_changes++] = e - watched_nicks;
     }
+}
 
-    char line[256];
-    int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
-    *total_usage = 0.0;
+// Look up the watched nicks once, when the module is loaded
+static void watched_init(void) {
+    for (int i = 0; i < num_nicks; i++) {
+        Client *acptr = find_user(watched_nicks[i].nick, NULL);
 
-    while (fgets(line, sizeof(line), fp)) {
-        if (strncmp(line, "cpu", 3) != 0 || (!isspace(line[3]) && !isdigit(line[3])))
-            break;
+        watched_nicks[i].online = acptr != NULL;
+        watched_nicks[i].since = acptr ? acptr->lastnick : 0;
+    }
+    if (num_nicks)
+        watched_changes = safe_alloc(sizeof(int) * num_nicks);
+}
 
-        unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
-        int index;
+static void watched_free(void) {
+    for (int i = 0; i < num_nicks; i++) {
+        free(watched_nicks[i].nick);
+    }
+    safe_free(watched_nicks);
+    safe_free(watched_hash);
+    safe_free(watched_changes);
+    num_nicks = watched_nicks_size = num_watched_changes = 0;
+    watched_hash_size = 0;
+}
 
-        if (isspace(line[3])) {
-            index = 0;
-            sscanf(line, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
-                   &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
-        } else {
-            int parsed_core;
-            sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu",
-                   &parsed_core, &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
-            if (parsed_core >= cpu_count)
-                break;
-            index = parsed_core + 1;
-        }
+static long long stats_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        unsigned long long idle_time = idle + iowait;
-        unsigned long long total_time = user + nice + system + idle + iowait + irq + softirq + steal;
+/*
+ * Host metrics are sampled every sample-interval by socketstats_sample_evt()
+ * rather than on each request, so the CPU usage covers a fixed period no
+ * matter how often the stats are read, and a request costs no system calls.
+ * The last 15 minutes of samples are kept for the averages. The state is a
+ * persistent pointer, so a REHASH keeps the averages and the CPU counters.
+ */
+
+struct host_sample {
+    long long time;         // monotonic ms
+    double cpu_usage;       // percent since the previous sample
+    long ram_total_mb, ram_used_mb;
+    long disk_total_mb, disk_free_mb;
+};
 
-        unsigned long long delta_idle = idle_time - prev_idle[index];
-        unsigned long long delta_total = total_time - prev_total[index];
+struct cpu_counters {
+    unsigned long long total, idle;
+};
 
-        double usage = (delta_total > 0) ? (1.0 - (double)delta_idle / delta_total) * 100.0 : 0.0;
+struct host_state {
+    int stat_fd;                    // /proc/stat, kept open and read with pread()
+    struct stats_buf stat_buf;
+    struct cpu_counters cpu, *cores; // counters as of the previous sample
+    double *core_usage;             // percent since the previous sample
+    int num_cores, cores_size;
+    int cpu_count;                  // online CPUs
+    char ipv4[INET_ADDRSTRLEN], ipv6[INET6_ADDRSTRLEN];
+    struct host_sample latest;
+    struct host_sample *ring;       // ring_size samples, the newest before ring_next
+    int ring_size, ring_len, ring_next;
+};
 
-        prev_idle[index] = idle_time;
-        prev_total[index] = total_time;
+static struct host_state *host = NULL;
 
-        if (index == 0) {
-            *total_usage = usage;
-        } else {
-            char key[16];
-            snprintf(key, sizeof(key), "core%d", index - 1);
-            json_object_set_new(core_obj, key, json_real(usage));
-        }
+#define HOST_HISTORY_MS (15 * 60 * 1000)
+
+// Parse one "cpu" line of /proc/stat from after the name, into the usage
+// since 'prev', which is then updated
+static double cpu_usage_update(const char *p, struct cpu_counters *prev) {
+    unsigned long long v[8] = { 0 }, total = 0, idle, delta_total, delta_idle;
+    char *end;
+    int i;
+
+    // user nice system idle iowait irq softirq steal; guest is already in user
+    for (i = 0; i < 8; i++) {
+        v[i] = strtoull(p, &end, 10);
+        if (end == p)
+            break;
+        total += v[i];
+        p = end;
+    }
+    idle = v[3] + v[4];
+    delta_total = total - prev->total;
+    delta_idle = idle - prev->idle;
+    // Counters of a core that was taken offline and back start over
+    if (total < prev->total || idle < prev->idle || delta_idle > delta_total)
+        delta_total = 0;
+    prev->total = total;
+    prev->idle = idle;
+    return delta_total > 0 ? (1.0 - (double)delta_idle / delta_total) * 100.0 : 0.0;
+}
+
+// Read the "cpu" lines of /proc/stat into the total and per-core usage. The
+// buffer grows until one read holds all of them, which with many cores takes
+// more than a page.
+static double get_cpu_info(void) {
+    struct stats_buf *b = &host->stat_buf;
+    double usage = 0.0;
+    ssize_t n;
+    char *line, *next;
+
+    if (host->stat_fd < 0)
+        return 0.0;
+    for (;;) {
+        stats_buf_reserve(b, 4096);
+        n = pread(host->stat_fd, b->data, b->size - 1, 0);
+        if (n <= 0)
+            return 0.0;
+        b->data[n] = '\0';
+        if ((size_t)n < b->size - 1 || strstr(b->data, "\nintr "))
+            break;
+        stats_buf_grow(b, b->size * 2);
     }
 
-    fclose(fp);
+    for (line = b->data; line && !strncmp(line, "cpu", 3); line = next) {
+        if ((next = strchr(line, '\n')))
+            *next++ = '\0';
+        if (line[3] == ' ') {
+            usage = cpu_usage_update(line + 3, &host->cpu);
+        } else if (isdigit(line[3])) {
+            char *p;
+            int core = (int)strtol(line + 3, &p, 10);
+
+            if (core >= host->cores_size) {
+                int size = host->cores_size ? host->cores_size : 16;
+                struct cpu_counters *cores;
+                double *core_usage;
+
+                while (size <= core)
+                    size *= 2;
+                cores = safe_alloc(sizeof(struct cpu_counters) * size);
+                core_usage = safe_alloc(sizeof(double) * size);
+                if (host->num_cores) {
+                    memcpy(cores, host->cores, sizeof(struct cpu_counters) * host->num_cores);
+                    memcpy(core_usage, host->core_usage, sizeof(double) * host->num_cores);
+                }
+                safe_free(host->cores);
+                safe_free(host->core_usage);
+                host->cores = cores;
+                host->core_usage = core_usage;
+                host->cores_size = size;
+            }
+            // Offline cores are not listed and stay at 0
+            host->core_usage[core] = cpu_usage_update(p, &host->cores[core]);
+            if (core >= host->num_cores)
+                host->num_cores = core + 1;
+        }
+    }
+    return usage;
 }
 
 void get_ram_info(long *total_mb, long *used_mb) {
@@ -171,7 +862,8 @@ void get_disk_info(long *total_mb, long *free_mb) {
 
 void get_ip_addresses(char *ipv4, size_t ipv4_len, char *ipv6, size_t ipv6_len) {
     struct ifaddrs *ifaddr, *ifa;
-    getifaddrs(&ifaddr);
+    if (getifaddrs(&ifaddr) < 0)
+        return;
     for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
         if (!ifa->ifa_addr || !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK))
             continue;
@@ -198,6 +890,370 @@ void get_ip_addresses(char *ipv4, size_t ipv4_len, char *ipv6, size_t ipv6_len)
     freeifaddrs(ifaddr);
 }
 
+// Read the host metrics into the latest sample
+static void host_sample_read(void) {
+    struct host_sample *s = &host->latest;
+
+    s->time = stats_now_ms();
+    s->cpu_usage = get_cpu_info();
+    get_ram_info(&s->ram_total_mb, &s->ram_used_mb);
+    get_disk_info(&s->disk_total_mb, &s->disk_free_mb);
+    host->cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    host->ipv4[0] = host->ipv6[0] = '\0';
+    get_ip_addresses(host->ipv4, sizeof(host->ipv4), host->ipv6, sizeof(host->ipv6));
+}
+
+// Take a sample and add it to the ring, replacing the oldest once it is full
+static void host_sample_take(void) {
+    host_sample_read();
+    host->ring[host->ring_next] = host->latest;
+    host->ring_next = (host->ring_next + 1) % host->ring_size;
+    if (host->ring_len < host->ring_size)
+        host->ring_len++;
+}
+
+// The newest sample
+static const struct host_sample *host_sample_latest(void) {
+    return &host->latest;
+}
+
+// Average CPU usage over the samples of the last 'minutes', or over all there
+// are if the module has not been loaded that long
+static double host_cpu_average(int minutes) {
+    long long since = stats_now_ms() - minutes * 60000LL;
+    double sum = 0.0;
+    int i, n = 0;
+
+    for (i = 1; i <= host->ring_len; i++) {
+        const struct host_sample *s = &host->ring[(host->ring_next + host->ring_size - i) % host->ring_size];
+        if (s->time < since)
+            break;
+        sum += s->cpu_usage;
+        n++;
+    }
+    return n ? sum / n : 0.0;
+}
+
+// Size the ring for the 15 minutes at sample-interval, keeping the newest
+// samples when it changed with a REHASH
+static void host_ring_resize(int size) {
+    struct host_sample *ring;
+    int i, len = host->ring_len < size ? host->ring_len : size;
+
+    if (size == host->ring_size)
+        return;
+    ring = safe_alloc(sizeof(struct host_sample) * size);
+    for (i = 0; i < len; i++)
+        ring[i] = host->ring[(host->ring_next + host->ring_size - len + i) % host->ring_size];
+    safe_free(host->ring);
+    host->ring = ring;
+    host->ring_size = size;
+    host->ring_len = len;
+    host->ring_next = len % size;
+}
+
+static void host_sampler_start(void) {
+    int i;
+
+    host_ring_resize(HOST_HISTORY_MS / sample_interval + 1);
+    if (host->stat_fd >= 0)
+        return; // carried over from before the REHASH
+    host->stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+    // There is nothing to compare the CPU counters with yet, so this only
+    // sets the base for the first sample. Its usage would be the average
+    // since boot, which does not belong in the ring or the output.
+    host_sample_read();
+    host->latest.cpu_usage = 0.0;
+    for (i = 0; i < host->num_cores; i++)
+        host->core_usage[i] = 0.0;
+}
+
+void host_state_free(ModData *m) {
+    struct host_state *st = m->ptr;
+
+    if (st) {
+        if (st->stat_fd >= 0)
+            close(st->stat_fd);
+        safe_free(st->stat_buf.data);
+        safe_free(st->cores);
+        safe_free(st->core_usage);
+        safe_free(st->ring);
+        safe_free(m->ptr);
+    }
+}
+
+EVENT(socketstats_sample_evt) {
+    host_sample_take();
+}
+
+/*
+ * Optional shared memory segment for local readers, see
+ * tools/socketstats_shm.h, which has the same layout and the reader side.
+ * Bump SHM_VERSION on any change.
+ */
+
+#define SHM_MAGIC 0x53534853
+#define SHM_VERSION 1
+#define SHM_SERVERS 64
+#define SHM_NAMELEN 64
+#define SHM_SERVER_LOCAL 0x1
+#define SHM_SERVER_ULINE 0x2
+
+struct shm_server {
+    char name[SHM_NAMELEN];
+    uint32_t users;
+    uint32_t flags;
+    int64_t boottime;
+};
+
+struct shm_stats {
+    uint32_t magic, version, size, server_size;
+    uint32_t seq;               // odd while being written
+    uint32_t pid;
+    int64_t updated_ms, started;
+    int64_t clients, channels, operators, servers, messages;
+    double cpu_usage, cpu_usage_avg[3];
+    int64_t ram_total_mb, ram_used_mb, disk_total_mb, disk_free_mb;
+    uint32_t cpu_count;
+    uint32_t num_servers;
+    struct shm_server serv[SHM_SERVERS];
+};
+
+static struct shm_stats *shm = NULL;
+
+// Rewrite the segment in place. Readers that see 'seq' odd, or changed by
+// the time they have copied it, try again.
+static void shm_update(void) {
+    const struct host_sample *sample = host_sample_latest();
+    struct timespec ts;
+    Client *acptr;
+    uint32_t n = 0;
+    int64_t servers = 0;
+
+    if (!shm)
+        return;
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    shm->updated_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    shm->clients = irccounts.clients;
+    shm->channels = irccounts.channels;
+    shm->operators = irccounts.operators;
+    shm->messages = counter;
+    shm->cpu_usage = sample->cpu_usage;
+    shm->cpu_usage_avg[0] = host_cpu_average(1);
+    shm->cpu_usage_avg[1] = host_cpu_average(5);
+    shm->cpu_usage_avg[2] = host_cpu_average(15);
+    shm->ram_total_mb = sample->ram_total_mb;
+    shm->ram_used_mb = sample->ram_used_mb;
+    shm->disk_total_mb = sample->disk_total_mb;
+    shm->disk_free_mb = sample->disk_free_mb;
+    shm->cpu_count = host->cpu_count;
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        struct shm_server *srv;
+
+        if (!acptr->server)
+            continue;
+        servers++;
+        if (n == SHM_SERVERS)
+            continue;
+        srv = &shm->serv[n++];
+        strlcpy(srv->name, acptr->name, sizeof(srv->name));
+        srv->users = acptr->server->users;
+        srv->flags = (acptr == &me ? SHM_SERVER_LOCAL : 0) | (IsULine(acptr) ? SHM_SERVER_ULINE : 0);
+        srv->boottime = acptr->server->boottime;
+    }
+    shm->servers = servers;
+    shm->num_servers = n;
+
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void shm_open_segment(void) {
+    struct stat st;
+    void *map;
+    int fd = open(shm_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    // The file is never made smaller, a reader may still have it mapped
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+        (st.st_size < (off_t)sizeof(struct shm_stats) && ftruncate(fd, sizeof(struct shm_stats)) < 0) ||
+        (map = mmap(NULL, sizeof(struct shm_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        unreal_log(ULOG_WARNING, "socketstats", "SOCKETSTATS_SHM_ERROR", NULL, "Cannot map $path: $error",
+                   log_data_string("path", shm_path), log_data_string("error", strerror(errno)));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    close(fd);
+    shm = map;
+
+    // Left odd if the IRCd died while writing: make it even again, and
+    // write the header under the lock like everything else
+    __atomic_store_n(&shm->seq, shm->seq | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm->magic = SHM_MAGIC;
+    shm->version = SHM_VERSION;
+    shm->size = sizeof(struct shm_stats);
+    shm->server_size = sizeof(struct shm_server);
+    shm->pid = getpid();
+    shm->started = TStime();
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+    shm_update();
+}
+
+static void shm_close_segment(void) {
+    if (shm)
+        munmap(shm, sizeof(struct shm_stats));
+    shm = NULL;
+}
+
+EVENT(socketstats_shm_evt) {
+    shm_update();
+}
+
+/*
+ * History: a sample every history-interval, appended to a fixed-size ring
+ * file that is mapped in whole and kept across restarts. Records are never
+ * reordered, so they are sorted by time and a range is found by bisection.
+ * With the default 64 MB and 1 minute, the file covers over a year.
+ */
+
+#define HISTORY_MAGIC 0x53534849
+#define HISTORY_VERSION 1
+#define HISTORY_HEADER_SIZE 4096
+#define HISTORY_SERVERS 16
+#define HISTORY_MAX_POINTS 10000
+
+struct history_header {
+    uint32_t magic, version, header_size, record_size;
+    uint64_t capacity;          // records the file has room for
+    uint64_t head;              // slot of the next record
+    uint64_t count;             // records written, at most capacity
+    char servers[HISTORY_SERVERS][64]; // which server each server_users[] slot is
+};
+
+struct history_record {
+    int64_t time;               // unix time
+    int64_t messages;           // messages during the interval up to 'time'
+    uint32_t clients, operators, channels, servers;
+    float cpu_usage;
+    uint32_t ram_used_mb;
+    uint32_t server_users[HISTORY_SERVERS];
+};
+
+static struct history_header *history = NULL;
+static size_t history_map_size = 0;
+static long long history_last_counter = 0;
+
+#define HISTORY_RECORDS ((struct history_record *)((char *)history + HISTORY_HEADER_SIZE))
+
+// The i-th oldest record
+static struct history_record *history_at(uint64_t i) {
+    return &HISTORY_RECORDS[(history->head + history->capacity - history->count + i) % history->capacity];
+}
+
+// The slot of a server in the records, taking a free one for a new server.
+// Returns -1 once all are taken.
+static int history_server_slot(const char *name, int add) {
+    int i;
+
+    for (i = 0; i < HISTORY_SERVERS && history->servers[i][0]; i++) {
+        if (!strcasecmp(history->servers[i], name))
+            return i;
+    }
+    if (!add || i == HISTORY_SERVERS)
+        return -1;
+    strlcpy(history->servers[i], name, sizeof(history->servers[i]));
+    return i;
+}
+
+static void history_append(void) {
+    const struct host_sample *sample = host_sample_latest();
+    struct history_record *r;
+    Client *acptr;
+
+    if (!history)
+        return;
+    // /history finds a range by bisection, so the records must stay in time
+    // order. While the wall clock is behind the newest record (stepped back
+    // by NTP or by hand) no record is written; the messages of the skipped
+    // intervals are counted in the next one.
+    if (history->count && TStime() < history_at(history->count - 1)->time)
+        return;
+    // Fill the slot first and publish it by moving the head, so a crash
+    // half way leaves the ring as it was
+    r = &HISTORY_RECORDS[history->head];
+    memset(r, 0, sizeof(*r));
+    r->time = TStime();
+    r->messages = counter - history_last_counter;
+    history_last_counter = counter;
+    r->clients = irccounts.clients;
+    r->operators = irccounts.operators;
+    r->channels = irccounts.channels;
+    r->cpu_usage = sample->cpu_usage;
+    r->ram_used_mb = sample->ram_used_mb;
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        int slot;
+
+        if (!acptr->server)
+            continue;
+        r->servers++;
+        if ((slot = history_server_slot(acptr->name, 1)) >= 0)
+            r->server_users[slot] = acptr->server->users;
+    }
+    history->head = (history->head + 1) % history->capacity;
+    if (history->count < history->capacity)
+        history->count++;
+}
+
+static void history_open(void) {
+    uint64_t capacity = (history_size - HISTORY_HEADER_SIZE) / sizeof(struct history_record);
+    size_t size = HISTORY_HEADER_SIZE + capacity * sizeof(struct history_record);
+    struct stat st;
+    void *map;
+    int fd = open(history_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+        ((size_t)st.st_size != size && ftruncate(fd, size) < 0) ||
+        (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        unreal_log(ULOG_WARNING, "socketstats", "SOCKETSTATS_HISTORY_ERROR", NULL, "Cannot map $path: $error",
+                   log_data_string("path", history_path), log_data_string("error", strerror(errno)));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    close(fd);
+    history = map;
+    history_map_size = size;
+
+    if (history->magic != HISTORY_MAGIC || history->version != HISTORY_VERSION ||
+        history->header_size != HISTORY_HEADER_SIZE || history->record_size != sizeof(struct history_record) ||
+        history->capacity != capacity || history->head >= capacity || history->count > capacity) {
+        if ((size_t)st.st_size)
+            unreal_log(ULOG_WARNING, "socketstats", "SOCKETSTATS_HISTORY_RESET", NULL,
+                       "History in $path has another size or format, starting over",
+                       log_data_string("path", history_path));
+        memset(history, 0, sizeof(*history));
+        history->magic = HISTORY_MAGIC;
+        history->version = HISTORY_VERSION;
+        history->header_size = HISTORY_HEADER_SIZE;
+        history->record_size = sizeof(struct history_record);
+        history->capacity = capacity;
+    }
+    history_last_counter = counter;
+}
+
+static void history_close(void) {
+    if (history)
+        munmap(history, history_map_size);
+    history = NULL;
+}
+
+EVENT(socketstats_history_evt) {
+    history_append();
+}
+
 int socketstats_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs) {
     ConfigEntry *cep;
     int errors = 0;
@@ -228,38 +1284,142 @@ int socketstats_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
             continue;
         }
 
-        if(!strcmp(cep->name, "nicks")) {
+        if(!strcmp(cep->name, "shm-path")) {
             if(!cep->value) {
-                config_error("%s:%i: %s::%s must be a list of nicks", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                config_error("%s:%i: %s::%s must be a path", cep->file->filename, cep->line_number, MYCONF, cep->name);
                 errors++;
-                continue;
             }
-            parse_nick_list(cep->value);
             continue;
         }
 
-        config_warn("%s:%i: unknown item %s::%s", cep->file->filename, cep->line_number, MYCONF, cep->name);
-    }
+        if(!strcmp(cep->name, "history-path")) {
+            if(!cep->value) {
+                config_error("%s:%i: %s::%s must be a path", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
 
-    *errs = errors;
-    return errors ? -1 : 1;
-}
+        if(!strcmp(cep->name, "history-size")) {
+            if(!cep->value || config_checkval(cep->value, CFG_SIZE) < 64*1024) {
+                config_error("%s:%i: %s::%s must be a size of at least 64k, e.g. 64m", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
 
-int socketstats_configposttest(int *errs) {
-    if(!socket_hpath){
-        config_warn("[socketstats] warning: socket path not specified! Socket won't be created. This module will not be useful.");
-    }
-    if(num_nicks == 0) {
-        config_warn("[socketstats] warning: no nicks specified! No nick status will be checked.");
-    }
-    return 1;
-}
+        if(!strcmp(cep->name, "history-interval")) {
+            if(!cep->value || config_checkval(cep->value, CFG_TIME) < 1) {
+                config_error("%s:%i: %s::%s must be a time, e.g. 1m", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
 
-int socketstats_configrun(ConfigFile *cf, ConfigEntry *ce, int type) {
-    ConfigEntry *cep;
+        if(!strcmp(cep->name, "shm-interval")) {
+            if(!cep->value || atol(cep->value) < 100) {
+                config_error("%s:%i: %s::%s must be a number of milliseconds, at least 100", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
 
-    if(type != CONFIG_MAIN)
-        return 0;
+        if(!strcmp(cep->name, "max-connections")) {
+            if(!cep->value || atoi(cep->value) < 1) {
+                config_error("%s:%i: %s::%s must be a positive number", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
+
+        if(!strcmp(cep->name, "max-sendq")) {
+            if(!cep->value || config_checkval(cep->value, CFG_SIZE) < 1) {
+                config_error("%s:%i: %s::%s must be a size, e.g. 16m", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
+
+        if(!strcmp(cep->name, "timeout")) {
+            if(!cep->value || config_checkval(cep->value, CFG_TIME) < 1) {
+                config_error("%s:%i: %s::%s must be a time, e.g. 30s", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
+
+        if(!strcmp(cep->name, "stream-interval")) {
+            if(!cep->value || atol(cep->value) < 100) {
+                config_error("%s:%i: %s::%s must be a number of milliseconds, at least 100", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
+
+        if(!strcmp(cep->name, "sample-interval")) {
+            if(!cep->value || atol(cep->value) < 1000) {
+                config_error("%s:%i: %s::%s must be a number of milliseconds, at least 1000", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
+
+        if(!strcmp(cep->name, "top-channels")) {
+            if(!cep->value || atoi(cep->value) < 1) {
+                config_error("%s:%i: %s::%s must be a positive number", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
+
+        if(!strcmp(cep->name, "metrics-max-channels") || !strcmp(cep->name, "render-thread-channels")) {
+            if(!cep->value || !isdigit(*cep->value)) {
+                config_error("%s:%i: %s::%s must be a number of channels", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
+
+        if(!strcmp(cep->name, "cache-max-age") || !strcmp(cep->name, "request-timeout")) {
+            if(!cep->value || !isdigit(*cep->value)) {
+                config_error("%s:%i: %s::%s must be a number of milliseconds", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+            }
+            continue;
+        }
+
+        if(!strcmp(cep->name, "nicks")) {
+            if(!cep->value || !cep->value[strspn(cep->value, ", ")]) {
+                config_error("%s:%i: %s::%s must be a list of nicks", cep->file->filename, cep->line_number, MYCONF, cep->name);
+                errors++;
+                continue;
+            }
+            socket_hnicks = 1;
+            continue;
+        }
+
+        config_warn("%s:%i: unknown item %s::%s", cep->file->filename, cep->line_number, MYCONF, cep->name);
+    }
+
+    *errs = errors;
+    return errors ? -1 : 1;
+}
+
+int socketstats_configposttest(int *errs) {
+    if(!socket_hpath){
+        config_warn("[socketstats] warning: socket path not specified! Socket won't be created. This module will not be useful.");
+    }
+    if(!socket_hnicks) {
+        config_warn("[socketstats] warning: no nicks specified! No nick status will be checked.");
+    }
+    return 1;
+}
+
+int socketstats_configrun(ConfigFile *cf, ConfigEntry *ce, int type) {
+    ConfigEntry *cep;
+
+    if(type != CONFIG_MAIN)
+        return 0;
 
     if(!ce || !ce->name)
         return 0;
@@ -272,7 +1432,70 @@ int socketstats_configrun(ConfigFile *cf, ConfigEntry *ce, int type) {
             socket_path = strdup(cep->value);
             continue;
         }
+        if(cep->value && !strcmp(cep->name, "shm-path")) {
+            safe_free(shm_path);
+            shm_path = strdup(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "history-path")) {
+            safe_free(history_path);
+            history_path = strdup(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "history-size")) {
+            history_size = config_checkval(cep->value, CFG_SIZE);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "history-interval")) {
+            history_interval = config_checkval(cep->value, CFG_TIME);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "shm-interval")) {
+            shm_interval = atol(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "max-connections")) {
+            max_connections = atoi(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "max-sendq")) {
+            max_sendq = config_checkval(cep->value, CFG_SIZE);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "timeout")) {
+            send_timeout = config_checkval(cep->value, CFG_TIME);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "cache-max-age")) {
+            cache_max_age = atol(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "request-timeout")) {
+            request_timeout = atol(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "stream-interval")) {
+            stream_interval = atol(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "sample-interval")) {
+            sample_interval = atol(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "top-channels")) {
+            top_channels_size = atoi(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "metrics-max-channels")) {
+            metrics_max_channels = atoi(cep->value);
+            continue;
+        }
+        if(cep->value && !strcmp(cep->name, "render-thread-channels")) {
+            render_thread_channels = atoi(cep->value);
+            continue;
+        }
         if(cep->value && !strcmp(cep->name, "nicks")) {
+            parse_nick_list(cep->value);
             continue;
         }
     }
@@ -289,6 +1512,7 @@ ModuleHeader MOD_HEADER = {
 
 MOD_TEST() {
     socket_hpath = 0;
+    socket_hnicks = 0;
     HookAdd(modinfo->handle, HOOKTYPE_CONFIGTEST, 0, socketstats_configtest);
     HookAdd(modinfo->handle, HOOKTYPE_CONFIGPOSTTEST, 0, socketstats_configposttest);
     return MOD_SUCCESS;
@@ -298,14 +1522,39 @@ MOD_INIT() {
     ModDataInfo mreq;
     HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, socketstats_configrun);
     HookAdd(modinfo->handle, HOOKTYPE_PRE_CHANMSG, 0, socketstats_msg);
+    HookAdd(modinfo->handle, HOOKTYPE_CHANNEL_CREATE, 0, socketstats_channel_create);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_JOIN, 0, socketstats_join);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_JOIN, 0, socketstats_join);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_PART, 0, socketstats_part);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_PART, 0, socketstats_part);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_KICK, 0, socketstats_kick);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_KICK, 0, socketstats_kick);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_QUIT, 0, socketstats_quit);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_QUIT, 0, socketstats_quit);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_CONNECT, 0, socketstats_connect);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_CONNECT, 0, socketstats_connect);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_NICKCHANGE, 0, socketstats_pre_nickchange);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_NICKCHANGE, 0, socketstats_pre_nickchange);
+    HookAdd(modinfo->handle, HOOKTYPE_POST_LOCAL_NICKCHANGE, 0, socketstats_post_nickchange);
+    HookAdd(modinfo->handle, HOOKTYPE_POST_REMOTE_NICKCHANGE, 0, socketstats_post_nickchange);
+    HookAdd(modinfo->handle, HOOKTYPE_TOPIC, 0, socketstats_topic);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_CHANMODE, 0, socketstats_chanmode);
+    HookAdd(modinfo->handle, HOOKTYPE_REMOTE_CHANMODE, 0, socketstats_chanmode);
+
+    // Host metrics and their history, kept across REHASH
+    LoadPersistentPointer(modinfo, host, host_state_free);
+    if (!host) {
+        host = safe_alloc(sizeof(struct host_state));
+        host->stat_fd = -1;
+    }
 
     memset(&mreq, 0, sizeof(mreq));
     mreq.type = MODDATATYPE_CHANNEL;
-    mreq.name = "message_count";
-    mreq.free = md_free;
-    message_count_md = ModDataAdd(modinfo->handle, mreq);
-    if(!message_count_md){
-        config_error("[%s] Failed to request message_count moddata: %s", MOD_HEADER.name, ModuleGetErrorStr(modinfo->handle));
+    mreq.name = "socketstats_channel";
+    mreq.free = channel_stats_free;
+    channel_stats_md = ModDataAdd(modinfo->handle, mreq);
+    if(!channel_stats_md){
+        config_error("[%s] Failed to request socketstats_channel moddata: %s", MOD_HEADER.name, ModuleGetErrorStr(modinfo->handle));
         return MOD_FAILED;
     }
 
@@ -320,166 +1569,2044 @@ MOD_LOAD() {
     }
 
     counter = 0;
+    watched_init();
 
     if(socket_path){
-        stats_socket = socket(PF_UNIX, SOCK_STREAM, 0);
-        bind(stats_socket, (struct sockaddr*) &stats_addr, SUN_LEN(&stats_addr));
-        chmod(stats_addr.sun_path, 0777);
-        listen(stats_socket, 5);
-        fcntl(stats_socket, F_SETFL, O_NONBLOCK);
+        stats_socket = fd_socket(AF_UNIX, SOCK_STREAM, 0, "socketstats listener");
+        if(stats_socket < 0 ||
+           bind(stats_socket, (struct sockaddr*) &stats_addr, SUN_LEN(&stats_addr)) < 0 ||
+           listen(stats_socket, 128) < 0){
+            unreal_log(ULOG_ERROR, "socketstats", "SOCKETSTATS_LISTEN_ERROR", NULL, "Cannot listen on $path: $error",
+                       log_data_string("path", socket_path), log_data_string("error", strerror(errno)));
+            if(stats_socket >= 0) fd_close(stats_socket);
+            stats_socket = -1;
+        } else {
+            chmod(stats_addr.sun_path, 0777);
+            fcntl(stats_socket, F_SETFL, O_NONBLOCK);
+            fd_setselect(stats_socket, FD_SELECT_READ, socketstats_accept, NULL);
+        }
     }
 
-    EventAdd(modinfo->handle, "socketstats_socket", socketstats_socket_evt, NULL, 100, 0);
+    EventAdd(modinfo->handle, "socketstats_timeout", socketstats_timeout_evt, NULL, 100, 0);
+    EventAdd(modinfo->handle, "socketstats_stream", socketstats_stream_evt, NULL, stream_interval, 0);
+    host_sampler_start();
+    EventAdd(modinfo->handle, "socketstats_sample", socketstats_sample_evt, NULL, sample_interval, 0);
+    if(history_path){
+        history_open();
+        EventAdd(modinfo->handle, "socketstats_history", socketstats_history_evt, NULL, history_interval * 1000, 0);
+    }
+    if(render_thread_channels > 0){
+        if(pipe(render_pipe) < 0){
+            unreal_log(ULOG_WARNING, "socketstats", "SOCKETSTATS_RENDER_THREAD_ERROR", NULL,
+                       "Cannot create the render thread pipe, rendering on the main thread: $error",
+                       log_data_string("error", strerror(errno)));
+            render_pipe[0] = render_pipe[1] = -1;
+        } else {
+            fcntl(render_pipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(render_pipe[1], F_SETFL, O_NONBLOCK);
+            fd_open(render_pipe[0], "socketstats render thread", 0);
+            fd_setselect(render_pipe[0], FD_SELECT_READ, render_job_done, NULL);
+        }
+    }
+    if(shm_path){
+        shm_open_segment();
+        EventAdd(modinfo->handle, "socketstats_shm", socketstats_shm_evt, NULL, shm_interval, 0);
+    }
 
     return MOD_SUCCESS;
 }
 
 MOD_UNLOAD() {
-    close(stats_socket);
-    unlink(stats_addr.sun_path);
+    while(stats_clients)
+        stats_client_free(stats_clients);
+    for (int i = 0; i < STATS_CACHE_SLOTS; i++) {
+        stats_snapshot_release(snapshot_cache[i]);
+        snapshot_cache[i] = NULL;
+    }
+    if(render_job)
+        stats_snapshot_release(render_job_join());
+    if(render_pipe[0] >= 0){
+        fd_close(render_pipe[0]);
+        close(render_pipe[1]);
+        render_pipe[0] = render_pipe[1] = -1;
+    }
+    safe_free(spare_buf.data);
+    stream_reset();
+    safe_free(delta_buf.data);
+    shm_close_segment();
+    safe_free(shm_path);
+    history_close();
+    safe_free(history_path);
+    SavePersistentPointer(modinfo, host);
+    // The channels' ModData is freed after this, it must not find the sketch
+    for (int i = 0; i < num_top_channels; i++)
+        top_channels[i].stats->top_slot = -1;
+    num_top_channels = 0;
+    safe_free(top_channels);
+    if(stats_socket >= 0){
+        fd_close(stats_socket);
+        unlink(stats_addr.sun_path);
+    }
 
     if(socket_path) free(socket_path);
 
-    if (selected_nicks) {
-        for (int i = 0; i < num_nicks; i++) {
-            free(selected_nicks[i]);
-        }
-        free(selected_nicks);
-    }
+    watched_free();
 
     return MOD_SUCCESS;
 }
 
-void md_free(ModData *md) {
-    md->i = 0;
+static struct channel_stats *channel_stats_get(Channel *channel) {
+    struct channel_stats *s = CHANNEL_STATS(channel);
+
+    if (!s) {
+        s = safe_alloc(sizeof(struct channel_stats));
+        s->channel = channel;
+        s->top_slot = -1;
+        moddata_channel(channel, channel_stats_md).ptr = s;
+    }
+    return s;
+}
+
+static void channel_dirty_unlink(struct channel_stats *s) {
+    if (s->dirty_prev)
+        s->dirty_prev->dirty_next = s->dirty_next;
+    else
+        dirty_channels = s->dirty_next;
+    if (s->dirty_next)
+        s->dirty_next->dirty_prev = s->dirty_prev;
+    s->dirty_prev = s->dirty_next = NULL;
+    s->dirty = 0;
+}
+
+// A published field of the channel changed: send it with the next delta
+static void channel_mark_dirty(Channel *channel) {
+    struct channel_stats *s;
+
+    if (!stream_subscribers)
+        return;
+    s = channel_stats_get(channel);
+    if (s->dirty)
+        return;
+    s->dirty = 1;
+    s->dirty_prev = NULL;
+    s->dirty_next = dirty_channels;
+    if (dirty_channels)
+        dirty_channels->dirty_prev = s;
+    dirty_channels = s;
+}
+
+// Announce a channel as gone with the next delta
+static void gone_channel_add(const char *name) {
+    if (num_gone_channels == gone_channels_size) {
+        char **bigger;
+        gone_channels_size = gone_channels_size ? gone_channels_size * 2 : 16;
+        bigger = safe_alloc(sizeof(char *) * gone_channels_size);
+        if (num_gone_channels)
+            memcpy(bigger, gone_channels, sizeof(char *) * num_gone_channels);
+        safe_free(gone_channels);
+        gone_channels = bigger;
+    }
+    gone_channels[num_gone_channels++] = strdup(name);
+}
+
+// Messages in the last 'seconds' seconds, up to CHANNEL_RATE_SECONDS
+static long long channel_rate_sum(const struct channel_stats *s, time_t now, int seconds) {
+    long long sum = 0;
+    time_t t;
+
+    for (t = now - seconds + 1; t <= now; t++) {
+        if (t > s->rate_time - CHANNEL_RATE_SECONDS && t <= s->rate_time)
+            sum += s->rate[t % CHANNEL_RATE_SECONDS];
+    }
+    return sum;
+}
+
+static void channel_rate_add(struct channel_stats *s, time_t now) {
+    unsigned short *bucket;
+
+    if (now - s->rate_time >= CHANNEL_RATE_SECONDS) {
+        memset(s->rate, 0, sizeof(s->rate));
+    } else {
+        // Clear the seconds without messages since the last one
+        while (s->rate_time < now)
+            s->rate[++s->rate_time % CHANNEL_RATE_SECONDS] = 0;
+    }
+    s->rate_time = now;
+    bucket = &s->rate[now % CHANNEL_RATE_SECONDS];
+    if (*bucket < USHRT_MAX)
+        (*bucket)++;
+}
+
+static void top_swap(int a, int b) {
+    struct top_entry tmp = top_channels[a];
+
+    top_channels[a] = top_channels[b];
+    top_channels[b] = tmp;
+    top_channels[a].stats->top_slot = a;
+    top_channels[b].stats->top_slot = b;
+}
+
+static void top_down(int i) {
+    for (;;) {
+        int least = i, l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < num_top_channels && top_channels[l].count < top_channels[least].count)
+            least = l;
+        if (r < num_top_channels && top_channels[r].count < top_channels[least].count)
+            least = r;
+        if (least == i)
+            return;
+        top_swap(i, least);
+        i = least;
+    }
+}
+
+static void top_up(int i) {
+    while (i > 0 && top_channels[i].count < top_channels[(i - 1) / 2].count) {
+        top_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+// Halve the counts for every TOP_HALF_LIFE seconds passed. Halving keeps
+// the heap order.
+static void top_decay(time_t now) {
+    int i;
+
+    if (now - top_decayed >= 62 * TOP_HALF_LIFE) {
+        for (i = 0; i < num_top_channels; i++)
+            top_channels[i].count = 0;
+        top_decayed = now;
+    }
+    for (; now - top_decayed >= TOP_HALF_LIFE; top_decayed += TOP_HALF_LIFE) {
+        for (i = 0; i < num_top_channels; i++)
+            top_channels[i].count /= 2;
+    }
+}
+
+// Count a message in the sketch. A channel that is not tracked takes over
+// the entry with the lowest count, inheriting that count plus one: its own
+// count may be overestimated, but a channel busier than the least tracked
+// one is never missed.
+static void top_add(struct channel_stats *s, time_t now) {
+    int i;
+
+    top_decay(now);
+    if (s->top_slot >= 0) {
+        i = s->top_slot;
+        top_channels[i].count++;
+        top_down(i);
+        return;
+    }
+    if (!top_channels)
+        top_channels = safe_alloc(sizeof(struct top_entry) * top_channels_size);
+    if (num_top_channels < top_channels_size) {
+        i = num_top_channels++;
+        top_channels[i].stats = s;
+        top_channels[i].count = 1;
+        s->top_slot = i;
+        top_up(i);
+        return;
+    }
+    top_channels[0].stats->top_slot = -1;
+    top_channels[0].stats = s;
+    top_channels[0].count++;
+    s->top_slot = 0;
+    top_down(0);
+}
+
+static void top_remove(struct channel_stats *s) {
+    int i = s->top_slot;
+
+    s->top_slot = -1;
+    if (i != --num_top_channels) {
+        top_channels[i] = top_channels[num_top_channels];
+        top_channels[i].stats->top_slot = i;
+        top_down(i);
+        top_up(i);
+    }
+}
+
+void channel_stats_free(ModData *md) {
+    struct channel_stats *s = md->ptr;
+
+    if (!s)
+        return;
+    if (s->dirty)
+        channel_dirty_unlink(s);
+    if (s->top_slot >= 0)
+        top_remove(s);
+    if (stream_subscribers && s->was_public)
+        gone_channel_add(s->channel->name);
+    safe_free(md->ptr);
 }
 
 int socketstats_msg(Client *sptr, Channel *chptr, MessageTag **mtags, const char *msg, MESSAGE_SENDTYPE sendtype) {
+    struct channel_stats *s = channel_stats_get(chptr);
+    time_t now = TStime();
+
     counter++;
-    CHANNEL_MESSAGE_COUNT(chptr)++;
+    s->messages++;
+    channel_rate_add(s, now);
+    if (PubChannel(chptr))
+        top_add(s, now);
     return HOOK_CONTINUE;
 }
 
-EVENT(socketstats_socket_evt) {
-    char topic[6*TOPICLEN+1];
-    char name[6*CHANNELLEN+1];
-    int sock;
-    struct sockaddr_un cli_addr;
-    socklen_t slen;
-    Client *acptr;
-    Channel *channel;
-    unsigned int hashnum;
-    json_t *output = NULL;
-    json_t *servers = NULL;
-    json_t *channels = NULL;
-    json_t *server_j = NULL;
-    json_t *channel_j = NULL;
-    json_t *nicks_status = NULL;
-    char *result;
+int socketstats_channel_create(Channel *channel) {
+    channel_stats_get(channel);
+    channel_mark_dirty(channel);
+    return 0;
+}
 
-    if (!socket_hpath) return;
+int socketstats_join(Client *client, Channel *channel, MessageTag *mtags) {
+    channel_mark_dirty(channel);
+    return 0;
+}
 
-    sock = accept(stats_socket, (struct sockaddr*) &cli_addr, &slen);
-    slen = sizeof(cli_addr);
+int socketstats_part(Client *client, Channel *channel, MessageTag *mtags, const char *comment) {
+    channel_mark_dirty(channel);
+    return 0;
+}
 
-    if (sock < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) return;
-        unreal_log(ULOG_ERROR, "socketstats", "SOCKETSTATS_ACCEPT_ERROR", NULL, "Socket accept error: $error", log_data_string("error", strerror(errno)));
-        return;
+int socketstats_kick(Client *client, Client *victim, Channel *channel, MessageTag *mtags, const char *comment) {
+    channel_mark_dirty(channel);
+    return 0;
+}
+
+int socketstats_quit(Client *client, MessageTag *mtags, const char *comment) {
+    Membership *mp;
+
+    if (!client->user)
+        return 0;
+    watched_set(client->name, 0);
+    if (!stream_subscribers)
+        return 0;
+    for (mp = client->user->channel; mp; mp = mp->next) {
+        channel_mark_dirty(mp->channel);
     }
+    return 0;
+}
+
+// Keep the presence of watched nicks up to date. A nick change takes the old
+// nick offline before the new one comes online.
+int socketstats_connect(Client *client) {
+    watched_set(client->name, 1);
+    return 0;
+}
+
+int socketstats_pre_nickchange(Client *client, MessageTag *mtags, const char *newnick) {
+    watched_set(client->name, 0);
+    return 0;
+}
+
+int socketstats_post_nickchange(Client *client, MessageTag *mtags, const char *oldnick) {
+    watched_set(client->name, 1);
+    return 0;
+}
+
+int socketstats_topic(Client *client, Channel *channel, MessageTag *mtags, const char *topic) {
+    channel_mark_dirty(channel);
+    return 0;
+}
+
+// +s and +p move a channel in or out of the published set
+int socketstats_chanmode(Client *client, Channel *channel, MessageTag *mtags, const char *modebuf, const char *parabuf, time_t sendts, int samode) {
+    channel_mark_dirty(channel);
+    return 0;
+}
 
-    output = json_object();
-    servers = json_array();
-    channels = json_array();
-    nicks_status = json_array();
+static void render_counts(struct json_writer *w) {
+    jw_key_int(w, "clients", irccounts.clients);
+    jw_key_int(w, "channels", irccounts.channels);
+    jw_key_int(w, "operators", irccounts.operators);
+    jw_key_int(w, "messages", counter);
+}
 
+static void render_servers(struct json_writer *w) {
+    Client *acptr;
     int server_count = 0;
 
-    json_object_set_new(output, "clients", json_integer(irccounts.clients));
-    json_object_set_new(output, "channels", json_integer(irccounts.channels));
-    json_object_set_new(output, "operators", json_integer(irccounts.operators));
-    json_object_set_new(output, "messages", json_integer(counter));
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        if (acptr->server)
+            server_count++;
+    }
+    jw_key_int(w, "servers", server_count);
 
+    jw_key(w, "serv");
+    jw_array_open(w);
     list_for_each_entry(acptr, &global_server_list, client_node) {
         if (!acptr->server) continue;
 
-        server_count++;
-
-        server_j = json_object();
-        json_object_set_new(server_j, "name", json_string_unreal(acptr->name));
-        json_object_set_new(server_j, "users", json_integer(acptr->server->users));
-        json_object_set_new(server_j, "uptime", json_integer((int)(TStime() - acptr->server->boottime)));
-        json_object_set_new(server_j, "is_uline", IsULine(acptr) ? json_true() : json_false());
+        jw_object_open(w);
+        jw_key_str(w, "name", acptr->name);
+        jw_key_int(w, "users", acptr->server->users);
+        jw_key_int(w, "uptime", (int)(TStime() - acptr->server->boottime));
+        jw_key_bool(w, "is_uline", IsULine(acptr));
 
         if (acptr == &me) {
-            long ram_total, ram_used, disk_total, disk_free;
-            char ip4[INET_ADDRSTRLEN] = "", ip6[INET6_ADDRSTRLEN] = "";
-
-            get_ram_info(&ram_total, &ram_used);
-            get_disk_info(&disk_total, &disk_free);
-            get_ip_addresses(ip4, sizeof(ip4), ip6, sizeof(ip6));
-
-            json_object_set_new(server_j, "is_local", json_true());
-            
-            int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
-            json_object_set_new(server_j, "cpu_cores", json_integer(cpu_count));
-
-            double cpu_usage_total;
-            json_t *core_usages = json_object();
-            get_cpu_info(&cpu_usage_total, core_usages);
-
-            json_object_set_new(server_j, "cpu_usage_percent", json_real(cpu_usage_total));
-            json_object_set_new(server_j, "cpu_core_usage_percent", core_usages);
-            json_object_set_new(server_j, "ram_total_mb", json_integer(ram_total));
-            json_object_set_new(server_j, "ram_used_mb", json_integer(ram_used));
-            json_object_set_new(server_j, "disk_total_mb", json_integer(disk_total));
-            json_object_set_new(server_j, "disk_free_mb", json_integer(disk_free));
-            json_object_set_new(server_j, "host_ipv4", json_string(ip4));
-            json_object_set_new(server_j, "host_ipv6", json_string(ip6));
+            const struct host_sample *sample = host_sample_latest();
+
+            jw_key_bool(w, "is_local", 1);
+            jw_key_int(w, "cpu_cores", host->cpu_count);
+            jw_key_double(w, "cpu_usage_percent", sample->cpu_usage);
+            jw_key(w, "cpu_usage_percent_avg");
+            jw_object_open(w);
+            jw_key_double(w, "1m", host_cpu_average(1));
+            jw_key_double(w, "5m", host_cpu_average(5));
+            jw_key_double(w, "15m", host_cpu_average(15));
+            jw_object_close(w);
+            jw_key(w, "cpu_core_usage_percent");
+            jw_object_open(w);
+            for (int i = 0; i < host->num_cores; i++) {
+                char key[16];
+                snprintf(key, sizeof(key), "core%d", i);
+                jw_key_double(w, key, host->core_usage[i]);
+            }
+            jw_object_close(w);
+            jw_key_int(w, "ram_total_mb", sample->ram_total_mb);
+            jw_key_int(w, "ram_used_mb", sample->ram_used_mb);
+            jw_key_int(w, "disk_total_mb", sample->disk_total_mb);
+            jw_key_int(w, "disk_free_mb", sample->disk_free_mb);
+            jw_key_str(w, "host_ipv4", host->ipv4);
+            jw_key_str(w, "host_ipv6", host->ipv6);
         } else {
-            json_object_set_new(server_j, "is_local", json_false());
+            jw_key_bool(w, "is_local", 0);
         }
 
-        json_array_append_new(servers, server_j);
+        jw_object_close(w);
     }
+    jw_array_close(w);
+}
 
-    json_object_set_new(output, "servers", json_integer(server_count));
-    json_object_set_new(output, "serv", servers);
+// An online nick has the time it came online, an offline one the time it was
+// last seen, or null if not since the module was loaded
+static void render_watched_nick(struct json_writer *w, const struct watched_nick *e) {
+    jw_object_open(w);
+    jw_key_str(w, "nick", e->nick);
+    jw_key_bool(w, "online", e->online);
+    jw_key(w, e->online ? "online_since" : "last_seen");
+    if (e->since)
+        jw_int(w, e->since);
+    else
+        jw_null(w);
+    jw_object_close(w);
+}
 
-    if (num_nicks > 0) {
-        for (int i = 0; i < num_nicks; i++) {
-            Client *nick = find_user(selected_nicks[i], NULL);
-            json_t *nick_status = json_object();
-            json_object_set_new(nick_status, "nick", json_string(selected_nicks[i]));
-            json_object_set_new(nick_status, "online", nick ? json_true() : json_false());
-            json_array_append_new(nicks_status, nick_status);
-        }
+static void render_nicks(struct json_writer *w) {
+    jw_key(w, "nicks_status");
+    jw_array_open(w);
+    for (int i = 0; i < num_nicks; i++) {
+        render_watched_nick(w, &watched_nicks[i]);
     }
-    json_object_set_new(output, "nicks_status", nicks_status);
+    jw_array_close(w);
+}
+
+static void render_channel(struct json_writer *w, Channel *channel, int fields) {
+    stats_json_channel(w, fields, channel->name, channel->users, CHANNEL_MESSAGE_COUNT(channel), channel->topic);
+}
+
+// All public channels in hash order, as in the full document
+static void render_all_channels(struct json_writer *w) {
+    Channel *channel;
+    unsigned int hashnum;
 
+    jw_key(w, "chan");
+    jw_array_open(w);
     for (hashnum = 0; hashnum < CHAN_HASH_TABLE_SIZE; hashnum++) {
         for (channel = hash_get_chan_bucket(hashnum); channel; channel = channel->hnextch) {
             if (!PubChannel(channel)) continue;
-            channel_j = json_object();
-            json_object_set_new(channel_j, "name", json_string_unreal(channel->name));
-            json_object_set_new(channel_j, "users", json_integer(channel->users));
-            json_object_set_new(channel_j, "messages", json_integer(CHANNEL_MESSAGE_COUNT(channel)));
-            if (channel->topic)
-                json_object_set_new(channel_j, "topic", json_string_unreal(channel->topic));
-            json_array_append_new(channels, channel_j);
+            render_channel(w, channel, CHANNEL_FIELDS_ALL);
+        }
+    }
+    jw_array_close(w);
+}
+
+enum channel_sort { CHANNEL_SORT_NONE, CHANNEL_SORT_USERS, CHANNEL_SORT_MESSAGES, CHANNEL_SORT_NAME };
+
+// Parameters of a /channels request
+struct channel_query {
+    int min_users;
+    enum channel_sort sort;
+    int limit;          // -1 for no limit
+    int offset;
+    int fields;
+};
+
+static enum channel_sort channel_sort_mode; // for channel_rank_cmp() under qsort()
+
+// Order of two channels in a sorted listing: negative if 'a' comes first.
+// Counts sort descending, names ascending, ties are broken by name so pages
+// do not shift between requests.
+static int channel_rank(const Channel *a, const Channel *b, enum channel_sort sort) {
+    long long d = 0;
+
+    if (sort == CHANNEL_SORT_USERS)
+        d = (long long)b->users - a->users;
+    else if (sort == CHANNEL_SORT_MESSAGES)
+        d = (long long)CHANNEL_MESSAGE_COUNT(b) - CHANNEL_MESSAGE_COUNT(a);
+    if (d)
+        return d < 0 ? -1 : 1;
+    return strcasecmp(a->name, b->name);
+}
+
+static int channel_rank_cmp(const void *a, const void *b) {
+    return channel_rank(*(Channel * const *)a, *(Channel * const *)b, channel_sort_mode);
+}
+
+// Restore the heap property below 'i'. The heap keeps the lowest ranked of the
+// best channels seen so far at its root, so it is the one to be replaced.
+static void channel_heap_down(Channel **heap, int n, int i, enum channel_sort sort) {
+    for (;;) {
+        int worst = i, l = 2 * i + 1, r = 2 * i + 2;
+        Channel *tmp;
+
+        if (l < n && channel_rank(heap[l], heap[worst], sort) > 0)
+            worst = l;
+        if (r < n && channel_rank(heap[r], heap[worst], sort) > 0)
+            worst = r;
+        if (worst == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+static void channel_heap_up(Channel **heap, int i, enum channel_sort sort) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        Channel *tmp;
+
+        if (channel_rank(heap[i], heap[parent], sort) <= 0)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+// A filtered, sorted and paginated listing of the public channels. When
+// sorting with a limit only the best offset+limit channels are kept, in a
+// bounded heap, so the whole set is never sorted.
+static void render_channels(struct json_writer *w, const struct channel_query *q) {
+    Channel *channel;
+    Channel **sel = NULL;
+    unsigned int hashnum;
+    int total = 0, n = 0, cap = 0, written = 0;
+    int keep = q->limit < 0 ? -1 : q->offset + q->limit;
+
+    if (q->sort != CHANNEL_SORT_NONE && keep != 0) {
+        cap = keep > 0 ? keep : 256;
+        sel = safe_alloc(sizeof(Channel *) * cap);
+    }
+
+    jw_key(w, "chan");
+    jw_array_open(w);
+    for (hashnum = 0; hashnum < CHAN_HASH_TABLE_SIZE; hashnum++) {
+        for (channel = hash_get_chan_bucket(hashnum); channel; channel = channel->hnextch) {
+            if (!PubChannel(channel) || channel->users < q->min_users) continue;
+            total++;
+            if (q->sort == CHANNEL_SORT_NONE) {
+                // Hash order: stream the page straight out
+                if (total > q->offset && (q->limit < 0 || written < q->limit)) {
+                    render_channel(w, channel, q->fields);
+                    written++;
+                }
+            } else if (keep < 0) {
+                if (n == cap) {
+                    Channel **bigger = safe_alloc(sizeof(Channel *) * cap * 2);
+                    memcpy(bigger, sel, sizeof(Channel *) * n);
+                    safe_free(sel);
+                    sel = bigger;
+                    cap *= 2;
+                }
+                sel[n++] = channel;
+            } else if (n < keep) {
+                sel[n] = channel;
+                channel_heap_up(sel, n++, q->sort);
+            } else if (keep > 0 && channel_rank(channel, sel[0], q->sort) < 0) {
+                sel[0] = channel;
+                channel_heap_down(sel, n, 0, q->sort);
+            }
+        }
+    }
+    if (sel) {
+        channel_sort_mode = q->sort;
+        qsort(sel, n, sizeof(Channel *), channel_rank_cmp);
+        for (int i = q->offset; i < n; i++) {
+            render_channel(w, sel[i], q->fields);
         }
+        safe_free(sel);
+    }
+    jw_array_close(w);
+    jw_key_int(w, "total", total);
+}
+
+// The exposition for /metrics. Every label value is a new series for the
+// scraper to store, so only the metrics-max-channels biggest channels get
+// their own series.
+static void render_metrics(struct stats_buf *b) {
+    Client *acptr;
+    Channel *channel, **top = NULL;
+    unsigned int hashnum;
+    int server_count = 0, total = 0, n = 0, i;
+
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        if (acptr->server)
+            server_count++;
+    }
+
+    om_family(b, "unrealircd_clients", "gauge", "Users on the network.");
+    om_int(b, "unrealircd_clients", NULL, NULL, irccounts.clients);
+    om_family(b, "unrealircd_channels", "gauge", "Channels on the network.");
+    om_int(b, "unrealircd_channels", NULL, NULL, irccounts.channels);
+    om_family(b, "unrealircd_operators", "gauge", "IRC operators on the network.");
+    om_int(b, "unrealircd_operators", NULL, NULL, irccounts.operators);
+    om_family(b, "unrealircd_servers", "gauge", "Servers on the network.");
+    om_int(b, "unrealircd_servers", NULL, NULL, server_count);
+    om_family(b, "unrealircd_messages", "counter", "Channel messages seen by this server since the module was loaded.");
+    om_int(b, "unrealircd_messages_total", NULL, NULL, counter);
+
+    om_family(b, "unrealircd_server_users", "gauge", "Users on each server.");
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        if (acptr->server)
+            om_int(b, "unrealircd_server_users", "server", acptr->name, acptr->server->users);
+    }
+    om_family(b, "unrealircd_server_uptime_seconds", "gauge", "Time since each server was started.");
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        if (acptr->server)
+            om_int(b, "unrealircd_server_uptime_seconds", "server", acptr->name, TStime() - acptr->server->boottime);
     }
-    json_object_set_new(output, "chan", channels);
 
-    result = json_dumps(output, JSON_COMPACT);
+    {
+        const struct host_sample *sample = host_sample_latest();
+
+        om_family(b, "unrealircd_host_cpu_usage_percent", "gauge", "CPU usage of this host over the last sample-interval.");
+        om_double(b, "unrealircd_host_cpu_usage_percent", NULL, NULL, sample->cpu_usage);
+        om_family(b, "unrealircd_host_cpu_usage_average_percent", "gauge", "CPU usage of this host averaged over the last minutes.");
+        om_double(b, "unrealircd_host_cpu_usage_average_percent", "window", "1m", host_cpu_average(1));
+        om_double(b, "unrealircd_host_cpu_usage_average_percent", "window", "5m", host_cpu_average(5));
+        om_double(b, "unrealircd_host_cpu_usage_average_percent", "window", "15m", host_cpu_average(15));
+        om_family(b, "unrealircd_host_cpu_core_usage_percent", "gauge", "CPU usage of each core over the last sample-interval.");
+        for (i = 0; i < host->num_cores; i++) {
+            char core[12];
+            snprintf(core, sizeof(core), "%d", i);
+            om_double(b, "unrealircd_host_cpu_core_usage_percent", "core", core, host->core_usage[i]);
+        }
+        om_family(b, "unrealircd_host_memory_total_bytes", "gauge", "RAM of this host.");
+        om_int(b, "unrealircd_host_memory_total_bytes", NULL, NULL, (long long)sample->ram_total_mb * 1024 * 1024);
+        om_family(b, "unrealircd_host_memory_used_bytes", "gauge", "RAM in use on this host.");
+        om_int(b, "unrealircd_host_memory_used_bytes", NULL, NULL, (long long)sample->ram_used_mb * 1024 * 1024);
+        om_family(b, "unrealircd_host_disk_total_bytes", "gauge", "Size of the root filesystem.");
+        om_int(b, "unrealircd_host_disk_total_bytes", NULL, NULL, (long long)sample->disk_total_mb * 1024 * 1024);
+        om_family(b, "unrealircd_host_disk_free_bytes", "gauge", "Free space on the root filesystem.");
+        om_int(b, "unrealircd_host_disk_free_bytes", NULL, NULL, (long long)sample->disk_free_mb * 1024 * 1024);
+    }
 
-    char http_header[512];
-    sprintf(http_header, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n", strlen(result));
+    // The biggest public channels, kept in the same bounded heap as /channels
+    if (metrics_max_channels > 0)
+        top = safe_alloc(sizeof(Channel *) * metrics_max_channels);
+    for (hashnum = 0; hashnum < CHAN_HASH_TABLE_SIZE; hashnum++) {
+        for (channel = hash_get_chan_bucket(hashnum); channel; channel = channel->hnextch) {
+            if (!PubChannel(channel)) continue;
+            total++;
+            if (n < metrics_max_channels) {
+                top[n] = channel;
+                channel_heap_up(top, n++, CHANNEL_SORT_USERS);
+            } else if (n > 0 && channel_rank(channel, top[0], CHANNEL_SORT_USERS) < 0) {
+                top[0] = channel;
+                channel_heap_down(top, n, 0, CHANNEL_SORT_USERS);
+            }
+        }
+    }
+    if (n) {
+        channel_sort_mode = CHANNEL_SORT_USERS;
+        qsort(top, n, sizeof(Channel *), channel_rank_cmp);
+    }
 
-    send(sock, http_header, strlen(http_header), 0);
-    send(sock, result, strlen(result), 0);
+    om_family(b, "unrealircd_channel_users", "gauge", "Users in each of the biggest public channels.");
+    for (i = 0; i < n; i++) {
+        om_int(b, "unrealircd_channel_users", "channel", top[i]->name, top[i]->users);
+    }
+    om_family(b, "unrealircd_channel_messages", "counter", "Messages seen by this server in each of the biggest public channels.");
+    for (i = 0; i < n; i++) {
+        om_int(b, "unrealircd_channel_messages_total", "channel", top[i]->name, CHANNEL_MESSAGE_COUNT(top[i]));
+    }
+    om_family(b, "unrealircd_channels_omitted", "gauge", "Public channels left out of the per-channel series by metrics-max-channels.");
+    om_int(b, "unrealircd_channels_omitted", NULL, NULL, total - n);
+    safe_free(top);
 
-    json_decref(output);
-    safe_free(result);
-    close(sock);
+    stats_buf_addstr(b, "# EOF\n");
 }
+
+// Decode %XX and '+' in a query string value, in place
+static void url_decode(char *s) {
+    char *o = s;
+
+    for (; *s; s++) {
+        if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            char hex[3] = { s[1], s[2], '\0' };
+            *o++ = (char)strtol(hex, NULL, 16);
+            s += 2;
+        } else {
+            *o++ = *s == '+' ? ' ' : *s;
+        }
+    }
+    *o = '\0';
+}
+
+static int query_number(const char *value, int *out) {
+    char *end;
+    long v = strtol(value, &end, 10);
+
+    if (!*value || *end || v < 0 || v > INT_MAX)
+        return 0;
+    *out = (int)v;
+    return 1;
+}
+
+static int parse_channel_query(char *query, struct channel_query *q) {
+    char *param, *value, *save = NULL;
+
+    memset(q, 0, sizeof(*q));
+    q->limit = -1;
+    q->fields = CHANNEL_FIELDS_ALL;
+
+    for (param = strtok_r(query, "&", &save); param; param = strtok_r(NULL, "&", &save)) {
+        if ((value = strchr(param, '=')))
+            *value++ = '\0';
+        else
+            value = "";
+        url_decode(value);
+
+        if (!strcmp(param, "min_users")) {
+            if (!query_number(value, &q->min_users))
+                return 0;
+        } else if (!strcmp(param, "limit")) {
+            if (!query_number(value, &q->limit))
+                return 0;
+        } else if (!strcmp(param, "offset")) {
+            if (!query_number(value, &q->offset))
+                return 0;
+        } else if (!strcmp(param, "sort")) {
+            if (!strcmp(value, "users"))
+                q->sort = CHANNEL_SORT_USERS;
+            else if (!strcmp(value, "messages"))
+                q->sort = CHANNEL_SORT_MESSAGES;
+            else if (!strcmp(value, "name"))
+                q->sort = CHANNEL_SORT_NAME;
+            else
+                return 0;
+        } else if (!strcmp(param, "fields")) {
+            char *field, *fsave = NULL;
+
+            q->fields = 0;
+            for (field = strtok_r(value, ",", &fsave); field; field = strtok_r(NULL, ",", &fsave)) {
+                if (!strcmp(field, "name"))
+                    q->fields |= CHANNEL_FIELD_NAME;
+                else if (!strcmp(field, "users"))
+                    q->fields |= CHANNEL_FIELD_USERS;
+                else if (!strcmp(field, "messages"))
+                    q->fields |= CHANNEL_FIELD_MESSAGES;
+                else if (!strcmp(field, "topic"))
+                    q->fields |= CHANNEL_FIELD_TOPIC;
+                else
+                    return 0;
+            }
+        } else {
+            return 0; // unknown parameter, better to say so than to ignore it
+        }
+    }
+    // No page holds more than every channel, and offset + limit has to fit
+    // in an int: it sizes the heap of the best channels
+    if (q->offset > irccounts.channels)
+        q->offset = irccounts.channels;
+    if (q->limit > irccounts.channels)
+        q->limit = irccounts.channels;
+    return 1;
+}
+
+#define CONTENT_TYPE_JSON "application/json"
+#define CONTENT_TYPE_OPENMETRICS "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+struct top_result {
+    Channel *channel;
+    long long messages;
+};
+
+static int top_result_cmp(const void *a, const void *b) {
+    const struct top_result *x = a, *y = b;
+
+    if (x->messages != y->messages)
+        return x->messages < y->messages ? 1 : -1;
+    return strcasecmp(x->channel->name, y->channel->name);
+}
+
+// The busiest public channels over the last 'window' seconds. Only the
+// channels in the sketch are looked at, and their exact counts are taken
+// from their per-second buckets, so this costs O(top-channels) however many
+// channels there are.
+static void render_top_channels(struct json_writer *w, int window, int limit) {
+    struct top_result *res = NULL;
+    time_t now = TStime();
+    int i, n = 0;
+
+    if (num_top_channels)
+        res = safe_alloc(sizeof(struct top_result) * num_top_channels);
+    for (i = 0; i < num_top_channels; i++) {
+        struct channel_stats *st = top_channels[i].stats;
+        long long messages;
+
+        if (!PubChannel(st->channel))
+            continue;
+        if ((messages = channel_rate_sum(st, now, window)) > 0) {
+            res[n].channel = st->channel;
+            res[n++].messages = messages;
+        }
+    }
+    if (n)
+        qsort(res, n, sizeof(struct top_result), top_result_cmp);
+
+    jw_key_int(w, "window", window);
+    jw_key(w, "chan");
+    jw_array_open(w);
+    for (i = 0; i < n && (limit < 0 || i < limit); i++) {
+        jw_object_open(w);
+        jw_key_str(w, "name", res[i].channel->name);
+        jw_key_int(w, "users", res[i].channel->users);
+        jw_key_int(w, "messages", res[i].messages);
+        jw_key_double(w, "rate", (double)res[i].messages / window);
+        jw_object_close(w);
+    }
+    jw_array_close(w);
+    safe_free(res);
+}
+
+static int parse_top_query(char *query, int *window, int *limit) {
+    char *param, *value, *save = NULL;
+
+    *window = CHANNEL_RATE_SECONDS;
+    *limit = -1;
+    for (param = strtok_r(query, "&", &save); param; param = strtok_r(NULL, "&", &save)) {
+        if ((value = strchr(param, '=')))
+            *value++ = '\0';
+        else
+            value = "";
+        url_decode(value);
+
+        if (!strcmp(param, "window")) {
+            if (!query_number(value, window) || *window < 1 || *window > CHANNEL_RATE_SECONDS)
+                return 0;
+        } else if (!strcmp(param, "limit")) {
+            if (!query_number(value, limit))
+                return 0;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+enum history_metric {
+    METRIC_CLIENTS, METRIC_OPERATORS, METRIC_CHANNELS, METRIC_SERVERS,
+    METRIC_MESSAGES, METRIC_CPU, METRIC_RAM, METRIC_USERS
+};
+
+static const char *history_metric_names[] = {
+    "clients", "operators", "channels", "servers", "messages", "cpu", "ram", "users", NULL
+};
+
+struct history_query {
+    enum history_metric metric;
+    int server_slot;            // for METRIC_USERS
+    long long since, until, step;
+};
+
+static double history_value(const struct history_record *r, const struct history_query *q) {
+    switch (q->metric) {
+        case METRIC_CLIENTS:   return r->clients;
+        case METRIC_OPERATORS: return r->operators;
+        case METRIC_CHANNELS:  return r->channels;
+        case METRIC_SERVERS:   return r->servers;
+        case METRIC_MESSAGES:  return r->messages;
+        case METRIC_CPU:       return r->cpu_usage;
+        case METRIC_RAM:       return r->ram_used_mb;
+        case METRIC_USERS:     return r->server_users[q->server_slot];
+    }
+    return 0;
+}
+
+// One point per 'step' seconds from 'since' that has samples: the average,
+// lowest and highest sample, or for messages the number sent in it
+static void render_history(struct json_writer *w, const struct history_query *q) {
+    uint64_t lo = 0, hi = history ? history->count : 0, i;
+    long long bucket = -1;
+    double sum = 0, min = 0, max = 0;
+    int n = 0;
+
+    // First record at or after 'since'
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (history_at(mid)->time < q->since)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    jw_key_str(w, "metric", history_metric_names[q->metric]);
+    jw_key_int(w, "step", q->step);
+    jw_key(w, "columns");
+    jw_array_open(w);
+    jw_str(w, "time");
+    if (q->metric == METRIC_MESSAGES) {
+        jw_str(w, "messages");
+    } else {
+        jw_str(w, "avg");
+        jw_str(w, "min");
+        jw_str(w, "max");
+    }
+    jw_array_close(w);
+    jw_key(w, "points");
+    jw_array_open(w);
+    for (i = lo; history && i <= history->count; i++) {
+        const struct history_record *r = i < history->count ? history_at(i) : NULL;
+        double v;
+
+        if (r && r->time > q->until)
+            r = NULL;
+        // Flush the bucket when the next record is past it or at the end
+        if (n && (!r || (r->time - q->since) / q->step != bucket)) {
+            jw_array_open(w);
+            jw_int(w, q->since + bucket * q->step);
+            if (q->metric == METRIC_MESSAGES) {
+                jw_int(w, (long long)sum);
+            } else {
+                jw_double(w, sum / n);
+                jw_double(w, min);
+                jw_double(w, max);
+            }
+            jw_array_close(w);
+            n = 0;
+        }
+        if (!r)
+            break;
+        v = history_value(r, q);
+        if (!n) {
+            bucket = (r->time - q->since) / q->step;
+            sum = 0;
+            min = max = v;
+        }
+        sum += v;
+        if (v < min) min = v;
+        if (v > max) max = v;
+        n++;
+    }
+    jw_array_close(w);
+}
+
+// A time is either unix time or, if negative, relative to now
+static int query_time(const char *value, long long *out) {
+    char *end;
+    long long v = strtoll(value, &end, 10);
+
+    if (!*value || *end)
+        return 0;
+    *out = v < 0 ? TStime() + v : v;
+    return 1;
+}
+
+static int parse_history_query(char *query, struct history_query *q) {
+    char *param, *value, *save = NULL, *server = NULL;
+    int i, step;
+
+    q->metric = METRIC_CLIENTS;
+    q->server_slot = -1;
+    q->until = TStime();
+    q->since = q->until - 24 * 3600;
+    q->step = history_interval;
+
+    for (param = strtok_r(query, "&", &save); param; param = strtok_r(NULL, "&", &save)) {
+        if ((value = strchr(param, '=')))
+            *value++ = '\0';
+        else
+            value = "";
+        url_decode(value);
+
+        if (!strcmp(param, "metric")) {
+            for (i = 0; history_metric_names[i] && strcmp(history_metric_names[i], value); i++);
+            if (!history_metric_names[i])
+                return 0;
+            q->metric = i;
+        } else if (!strcmp(param, "server")) {
+            server = value;
+        } else if (!strcmp(param, "since")) {
+            if (!query_time(value, &q->since))
+                return 0;
+        } else if (!strcmp(param, "until")) {
+            if (!query_time(value, &q->until))
+                return 0;
+        } else if (!strcmp(param, "step")) {
+            if (!query_number(value, &step) || step < 1)
+                return 0;
+            q->step = step;
+        } else {
+            return 0;
+        }
+    }
+    if (q->metric == METRIC_USERS) {
+        if (!server || !history || (q->server_slot = history_server_slot(server, 0)) < 0)
+            return 0;
+    } else if (server) {
+        return 0;
+    }
+    // Keep the response to a sensible size
+    if (q->until < q->since || (q->until - q->since) / q->step > HISTORY_MAX_POINTS)
+        return 0;
+    return 1;
+}
+
+// Render the response for a request target, e.g. "/channels?limit=10", into
+// 'buf' and set its 'content_type'. 'target' is modified. Returns NULL on
+// success or the HTTP status of the error.
+static const char *socketstats_render(struct stats_buf *buf, char *target, const char **content_type) {
+    struct json_writer writer, *w = &writer;
+    char *query;
+
+    if ((query = strchr(target, '?')))
+        *query++ = '\0';
+
+    *content_type = CONTENT_TYPE_JSON;
+    jw_init(w, buf);
+    if (!strcmp(target, "/")) {
+        jw_object_open(w);
+        render_counts(w);
+        render_servers(w);
+        render_nicks(w);
+        render_all_channels(w);
+        jw_object_close(w);
+    } else if (!strcmp(target, "/channels")) {
+        struct channel_query q;
+
+        if (!parse_channel_query(query ? query : "", &q))
+            return "400 Bad Request";
+        jw_object_open(w);
+        render_channels(w, &q);
+        jw_object_close(w);
+    } else if (!strcmp(target, "/servers")) {
+        jw_object_open(w);
+        render_servers(w);
+        jw_object_close(w);
+    } else if (!strcmp(target, "/nicks")) {
+        jw_object_open(w);
+        render_nicks(w);
+        jw_object_close(w);
+    } else if (!strcmp(target, "/top/channels")) {
+        int window, limit;
+
+        if (!parse_top_query(query ? query : "", &window, &limit))
+            return "400 Bad Request";
+        jw_object_open(w);
+        render_top_channels(w, window, limit);
+        jw_object_close(w);
+    } else if (!strcmp(target, "/history")) {
+        struct history_query q;
+
+        if (!history)
+            return "404 Not Found";
+        if (!parse_history_query(query ? query : "", &q))
+            return "400 Bad Request";
+        jw_object_open(w);
+        render_history(w, &q);
+        jw_object_close(w);
+    } else if (!strcmp(target, "/metrics")) {
+        if (query && *query)
+            return "400 Bad Request";
+        *content_type = CONTENT_TYPE_OPENMETRICS;
+        render_metrics(buf);
+    } else {
+        return "404 Not Found";
+    }
+    return NULL;
+}
+
+// Drop a reference to a snapshot. The buffer of the last one freed is kept
+// for the next render.
+static void stats_snapshot_release(struct stats_snapshot *snap) {
+    if (snap && --snap->refcount == 0) {
+        if (!spare_buf.data) {
+            spare_buf = snap->buf;
+        } else {
+            safe_free(snap->buf.data);
+        }
+        for (int i = 0; i < ENCODINGS; i++)
+            safe_free(snap->encoded[i].buf.data);
+        safe_free(snap->target);
+        safe_free(snap);
+    }
+}
+
+// Publish the rendered body and tag it. Runs on the worker thread for a
+// threaded render, so it must not touch anything but the snapshot.
+static void stats_snapshot_seal(struct stats_snapshot *snap) {
+    snap->data = snap->buf.data;
+    snap->len = snap->buf.len;
+    // The tag follows the content, not the generation, so a scraper whose
+    // data did not change gets a 304 even after a new render
+    snprintf(snap->etag, sizeof(snap->etag), "\"%016llx\"",
+             (unsigned long long)siphash_raw(snap->data, snap->len, etag_key));
+}
+
+// Compress a body with gzip, or for deflate with zlib framing as HTTP means it.
+// Returns 0 if zlib failed or the result would not be smaller.
+static int stats_compress(const char *data, size_t len, int encoding, struct stats_buf *out) {
+    z_stream zs;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, encoding == ENCODING_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    out->len = 0;
+    stats_buf_reserve(out, deflateBound(&zs, len));
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out->data;
+    zs.avail_out = out->size;
+    ret = deflate(&zs, Z_FINISH);
+    out->len = zs.total_out;
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END && out->len < len;
+}
+
+// Compress a snapshot in 'encoding', unless that was tried already. Like
+// stats_snapshot_seal() it only touches the snapshot, so the worker can call it.
+static void stats_snapshot_compress(struct stats_snapshot *snap, int encoding) {
+    struct stats_encoded *e = &snap->encoded[encoding];
+
+    if (e->tried || snap->len < COMPRESS_MIN_SIZE)
+        return;
+    e->tried = 1;
+    if (stats_compress(snap->data, snap->len, encoding, &e->buf))
+        snprintf(e->etag, sizeof(e->etag), "\"%.16s-%s\"", snap->etag + 1, encoding_names[encoding]);
+    else {
+        safe_free(e->buf.data);
+        memset(&e->buf, 0, sizeof(e->buf));
+    }
+}
+
+// Whether 'etag' is the tag of the snapshot in any representation. The tag of
+// a compressed one follows from the content, so this needs no compression.
+static int stats_snapshot_match(const struct stats_snapshot *snap, const char *etag) {
+    size_t len = strlen(snap->etag) - 1; // up to the closing quote
+
+    if (!strcmp(etag, snap->etag))
+        return 1;
+    if (strncmp(etag, snap->etag, len) || etag[len] != '-')
+        return 0;
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODINGS; i++) {
+        if (!strncmp(etag + len + 1, encoding_names[i], strlen(encoding_names[i])) &&
+            !strcmp(etag + len + 1 + strlen(encoding_names[i]), "\""))
+            return 1;
+    }
+    return 0;
+}
+
+// The encoding to send a snapshot in when the reader accepts 'encoding'. The
+// body is compressed once and then served from the snapshot.
+static int stats_snapshot_encode(struct stats_snapshot *snap, int encoding) {
+    if (encoding == ENCODING_IDENTITY)
+        return ENCODING_IDENTITY;
+    stats_snapshot_compress(snap, encoding);
+    return snap->encoded[encoding].buf.len ? encoding : ENCODING_IDENTITY;
+}
+
+/*
+ * Serializing the full document of a big network takes long enough to be
+ * felt by the users, so past render-thread-channels it is done on a worker
+ * thread. The main thread renders the small parts, copies what the channel
+ * list needs into one allocation and carries on; the worker writes the
+ * channel list into the snapshot and signals the pipe, and the main thread
+ * then answers the readers that were waiting for it. Only one render runs at
+ * a time.
+ */
+
+struct render_channel {
+    const char *name;
+    const char *topic;      // NULL if unset
+    int users;
+    long long messages;
+};
+
+struct render_job {
+    struct stats_snapshot *snap;
+    struct json_writer writer; // where the main thread left the document
+    int num_channels;
+    struct render_channel channels[]; // followed by the names and topics
+};
+
+static void *render_worker(void *data) {
+    struct render_job *job = data;
+    struct json_writer *w = &job->writer;
+    char c = 0;
+
+    jw_key(w, "chan");
+    jw_array_open(w);
+    for (int i = 0; i < job->num_channels; i++) {
+        const struct render_channel *rc = &job->channels[i];
+        stats_json_channel(w, CHANNEL_FIELDS_ALL, rc->name, rc->users, rc->messages, rc->topic);
+    }
+    jw_array_close(w);
+    jw_object_close(w);
+    stats_snapshot_seal(job->snap);
+    // Compressing a document this big would stall the event loop just the same
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODINGS; i++)
+        stats_snapshot_compress(job->snap, i);
+
+    while (write(render_pipe[1], &c, 1) < 0 && errno == EINTR);
+    return NULL;
+}
+
+static char *render_copy_string(char **arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = *arena;
+
+    memcpy(copy, s, len);
+    *arena += len;
+    return copy;
+}
+
+// Begin the full document in 'snap' and hand the channel list to the worker.
+// Returns 0 if no thread could be started, with 'snap' left untouched.
+static int render_job_start(struct stats_snapshot *snap) {
+    struct render_job *job;
+    Channel *channel;
+    unsigned int hashnum;
+    size_t strings = 0;
+    int n = 0;
+    char *arena;
+
+    if (render_job || render_pipe[0] < 0)
+        return 0;
+
+    for (hashnum = 0; hashnum < CHAN_HASH_TABLE_SIZE; hashnum++) {
+        for (channel = hash_get_chan_bucket(hashnum); channel; channel = channel->hnextch) {
+            if (!PubChannel(channel)) continue;
+            strings += strlen(channel->name) + 1 + (channel->topic ? strlen(channel->topic) + 1 : 0);
+            n++;
+        }
+    }
+    job = safe_alloc(sizeof(struct render_job) + sizeof(struct render_channel) * n + strings);
+    arena = (char *)&job->channels[n];
+    for (hashnum = 0; hashnum < CHAN_HASH_TABLE_SIZE; hashnum++) {
+        for (channel = hash_get_chan_bucket(hashnum); channel; channel = channel->hnextch) {
+            struct render_channel *rc;
+
+            if (!PubChannel(channel)) continue;
+            rc = &job->channels[job->num_channels++];
+            rc->name = render_copy_string(&arena, channel->name);
+            rc->topic = channel->topic ? render_copy_string(&arena, channel->topic) : NULL;
+            rc->users = channel->users;
+            rc->messages = CHANNEL_MESSAGE_COUNT(channel);
+        }
+    }
+
+    jw_init(&job->writer, &snap->buf);
+    jw_object_open(&job->writer);
+    render_counts(&job->writer);
+    render_servers(&job->writer);
+    render_nicks(&job->writer);
+
+    job->snap = snap;
+    snap->content_type = CONTENT_TYPE_JSON;
+    snap->pending = 1;
+    snap->refcount++; // the worker's
+    if (pthread_create(&render_thread, NULL, render_worker, job) != 0) {
+        snap->refcount--;
+        snap->pending = 0;
+        snap->buf.len = 0;
+        safe_free(job);
+        return 0;
+    }
+    render_job = job;
+    return 1;
+}
+
+// Wait for the worker to finish and take over its reference to the snapshot
+static struct stats_snapshot *render_job_join(void) {
+    struct stats_snapshot *snap = render_job->snap;
+
+    pthread_join(render_thread, NULL);
+    snap->pending = 0;
+    safe_free(render_job);
+    return snap;
+}
+
+// Get the snapshot for a request target with a reference for the caller. A new
+// one is rendered only when there is none younger than cache-max-age. With
+// 'threaded', a big full document is rendered on the worker thread and the
+// snapshot returned is still 'pending'. Returns NULL with the HTTP status in
+// 'error' if the target cannot be rendered.
+static struct stats_snapshot *stats_snapshot_get(const char *target, int threaded, const char **error) {
+    static uint64_t generation = 0;
+    struct stats_snapshot *snap;
+    long long now = stats_now_ms();
+    int i, slot = 0;
+    char *copy;
+
+    for (i = 0; i < STATS_CACHE_SLOTS; i++) {
+        snap = snapshot_cache[i];
+        if (!snap) {
+            slot = i;
+            continue;
+        }
+        if (!strcmp(snap->target, target)) {
+            // A pending one is as fresh as it gets, unless the caller cannot wait
+            if (snap->pending ? threaded : now - snap->created < cache_max_age) {
+                snap->refcount++;
+                return snap;
+            }
+            slot = i;
+            break;
+        }
+        // Otherwise replace the oldest, unless there is a free slot
+        if (snapshot_cache[slot] && snap->created < snapshot_cache[slot]->created)
+            slot = i;
+    }
+    if (!generation)
+        siphash_generate_key(etag_key);
+
+    snap = safe_alloc(sizeof(struct stats_snapshot));
+    snap->buf = spare_buf;
+    snap->buf.len = 0;
+    memset(&spare_buf, 0, sizeof(spare_buf));
+    snap->refcount = 1; // the cache's own reference
+    snap->generation = ++generation;
+    snap->created = now;
+    snap->target = strdup(target);
+
+    if (!threaded || render_thread_channels <= 0 || strcmp(target, "/") ||
+        irccounts.channels < render_thread_channels || !render_job_start(snap)) {
+        copy = strdup(target);
+        *error = socketstats_render(&snap->buf, copy, &snap->content_type);
+        safe_free(copy);
+        if (*error) {
+            stats_snapshot_release(snap);
+            return NULL;
+        }
+        stats_snapshot_seal(snap);
+    }
+
+    stats_snapshot_release(snapshot_cache[slot]);
+    snapshot_cache[slot] = snap;
+    snap->refcount++;
+    return snap;
+}
+
+static void stats_client_free(struct stats_client *sc) {
+    if (sc->prev)
+        sc->prev->next = sc->next;
+    else
+        stats_clients = sc->next;
+    if (sc->next)
+        sc->next->prev = sc->prev;
+    num_stats_clients--;
+    if (sc->stream)
+        stream_subscribers--;
+
+    fd_close(sc->fd);
+    stats_snapshot_release(sc->snapshot);
+    safe_free(sc->out.data);
+    safe_free(sc);
+}
+
+static void stats_client_writable(int fd, int revents, void *data);
+static void stats_client_readable(int fd, int revents, void *data);
+static int stats_client_process(struct stats_client *sc);
+
+// The response is out: get ready for the next request on the connection,
+// which stats_client_process() takes from the input buffer
+static void stats_client_next(struct stats_client *sc) {
+    stats_snapshot_release(sc->snapshot);
+    sc->snapshot = NULL;
+    sc->body = NULL;
+    sc->body_len = sc->pos = sc->header_len = 0;
+    sc->responding = sc->head = 0;
+    sc->if_none_match[0] = '\0';
+    sc->requests++;
+    sc->since = stats_now_ms();
+
+    sc->inlen -= sc->request_len;
+    memmove(sc->inbuf, sc->inbuf + sc->request_len, sc->inlen);
+    sc->request_len = 0;
+    fd_setselect(sc->fd, FD_SELECT_WRITE, NULL, sc);
+    fd_setselect(sc->fd, FD_SELECT_READ, stats_client_readable, sc);
+}
+
+// Write as much of the pending output as the socket takes, and keep the fd
+// registered for writing while some is left. A plain response frees the client
+// once it is sent, unless it is kept alive for the next request, and a stream
+// stays open. Returns 1 if the client was freed.
+static int stats_client_flush(struct stats_client *sc) {
+    size_t body_len = sc->body_len;
+    ssize_t n;
+
+    while (sc->pos < sc->header_len + body_len) {
+        struct iovec iov[2];
+        int iovcnt = 0;
+
+        if (sc->pos < sc->header_len) {
+            iov[iovcnt].iov_base = sc->header + sc->pos;
+            iov[iovcnt++].iov_len = sc->header_len - sc->pos;
+            if (body_len) {
+                iov[iovcnt].iov_base = (char *)sc->body;
+                iov[iovcnt++].iov_len = body_len;
+            }
+        } else {
+            iov[iovcnt].iov_base = (char *)sc->body + (sc->pos - sc->header_len);
+            iov[iovcnt++].iov_len = body_len - (sc->pos - sc->header_len);
+        }
+
+        n = writev(sc->fd, iov, iovcnt);
+        if (n < 0)
+            goto error;
+        sc->pos += n;
+    }
+    if (!sc->stream) {
+        if (sc->keep_alive) {
+            stats_client_next(sc);
+            return 0;
+        }
+        stats_client_free(sc);
+        return 1;
+    }
+
+    while (sc->out_pos < sc->out.len) {
+        n = write(sc->fd, sc->out.data + sc->out_pos, sc->out.len - sc->out_pos);
+        if (n < 0)
+            goto error;
+        sc->out_pos += n;
+    }
+    sc->out.len = sc->out_pos = 0;
+    fd_setselect(sc->fd, FD_SELECT_WRITE, NULL, sc);
+    return 0;
+
+error:
+    if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+        fd_setselect(sc->fd, FD_SELECT_WRITE, stats_client_writable, sc);
+        return 0;
+    }
+    stats_client_free(sc); // reader went away, nothing to report
+    return 1;
+}
+
+static void stats_client_writable(int fd, int revents, void *data) {
+    struct stats_client *sc = data;
+
+    if (!stats_client_flush(sc))
+        stats_client_process(sc);
+}
+
+// The Connection header, if the default for the request's version does not
+// say what happens after the response
+static const char *stats_client_connection(const struct stats_client *sc) {
+    if (!sc->keep_alive)
+        return "Connection: close\r\n";
+    return sc->http10 ? "Connection: keep-alive\r\n" : "";
+}
+
+// Queue a response without a body, e.g. an error or 304
+static void stats_client_status(struct stats_client *sc, const char *status, const char *etag) {
+    sc->header_len = snprintf(sc->header, sizeof(sc->header), "HTTP/1.1 %s\r\n%s%s%s%sContent-Length: 0\r\n\r\n",
+                              status, etag ? "ETag: " : "", etag ? etag : "", etag ? "\r\n" : "",
+                              stats_client_connection(sc));
+}
+
+// Stop reading from a client, its response is about to be queued
+static void stats_client_responding(struct stats_client *sc) {
+    sc->responding = 1;
+    sc->since = stats_now_ms();
+    fd_setselect(sc->fd, FD_SELECT_READ, NULL, sc);
+}
+
+// Answer with just a status line, e.g. for an error. Returns 1 if the client
+// was freed.
+static int stats_client_error(struct stats_client *sc, const char *status) {
+    stats_client_responding(sc);
+    stats_client_status(sc, status, NULL);
+    return stats_client_flush(sc);
+}
+
+// Send a rendered snapshot, taking over the caller's reference to it.
+// Returns 1 if the client was freed.
+static int stats_client_send(struct stats_client *sc, struct stats_snapshot *snap) {
+    int encoding;
+    const char *body, *etag;
+    size_t len;
+
+    // The reader has it already, in whichever encoding: no need to compress
+    if (sc->if_none_match[0] && stats_snapshot_match(snap, sc->if_none_match)) {
+        stats_client_status(sc, "304 Not Modified", sc->if_none_match);
+        stats_snapshot_release(snap);
+        return stats_client_flush(sc);
+    }
+
+    encoding = stats_snapshot_encode(snap, sc->encoding);
+    body = encoding ? snap->encoded[encoding].buf.data : snap->data;
+    len = encoding ? snap->encoded[encoding].buf.len : snap->len;
+    etag = encoding ? snap->encoded[encoding].etag : snap->etag;
+
+    if (len > (size_t)max_sendq) {
+        unreal_log(ULOG_WARNING, "socketstats", "SOCKETSTATS_SENDQ_EXCEEDED", NULL,
+                   "Stats response of $size bytes exceeds max-sendq ($max), dropping connection",
+                   log_data_integer("size", len), log_data_integer("max", max_sendq));
+        stats_snapshot_release(snap);
+        stats_client_free(sc);
+        return 1;
+    }
+
+    sc->header_len = snprintf(sc->header, sizeof(sc->header),
+                              "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nETag: %s\r\n%s%s%sVary: Accept-Encoding\r\n%s\r\n",
+                              snap->content_type, len, etag,
+                              encoding ? "Content-Encoding: " : "", encoding ? encoding_names[encoding] : "", encoding ? "\r\n" : "",
+                              stats_client_connection(sc));
+    if (sc->head) {
+        stats_snapshot_release(snap);
+    } else {
+        sc->snapshot = snap;
+        sc->body = body;
+        sc->body_len = len;
+    }
+
+    return stats_client_flush(sc);
+}
+
+// Answer a request for 'target'. 'if_none_match' is the tag the reader
+// already has, or NULL. Returns 1 if the client was freed.
+static int stats_client_respond(struct stats_client *sc, int head, const char *target, const char *if_none_match) {
+    const char *error = NULL;
+    struct stats_snapshot *snap = stats_snapshot_get(target, 1, &error);
+
+    if (!snap)
+        return stats_client_error(sc, error);
+    stats_client_responding(sc);
+    sc->head = head;
+    if (if_none_match)
+        strlcpy(sc->if_none_match, if_none_match, sizeof(sc->if_none_match));
+
+    if (snap->pending) {
+        // render_job_done() sends it once the worker is done
+        sc->snapshot = snap;
+        sc->waiting = 1;
+        return 0;
+    }
+    return stats_client_send(sc, snap);
+}
+
+// The worker signalled the pipe: send its snapshot to everyone waiting for it
+static void render_job_done(int fd, int revents, void *data) {
+    struct stats_client *sc, *next;
+    struct stats_snapshot *snap;
+    char c[16];
+
+    while (read(fd, c, sizeof(c)) > 0);
+    if (!render_job)
+        return;
+    snap = render_job_join();
+
+    for (sc = stats_clients; sc; sc = next) {
+        next = sc->next;
+        if (sc->waiting && sc->snapshot == snap) {
+            sc->waiting = 0;
+            sc->snapshot = NULL; // its reference goes to stats_client_send()
+            if (!stats_client_send(sc, snap))
+                stats_client_process(sc);
+        }
+    }
+    stats_snapshot_release(snap);
+}
+
+// Queue one event for a subscriber: an NDJSON line or a Server-Sent Event.
+// Returns 0 if the client was dropped for exceeding max-sendq.
+static int stream_queue_event(struct stats_client *sc, const char *type, const char *json, size_t len) {
+    if (sc->out.len - sc->out_pos + len > (size_t)max_sendq) {
+        unreal_log(ULOG_WARNING, "socketstats", "SOCKETSTATS_SENDQ_EXCEEDED", NULL,
+                   "Stream subscriber is not keeping up, more than max-sendq ($max) bytes queued, dropping connection",
+                   log_data_integer("max", max_sendq));
+        stats_client_free(sc);
+        return 0;
+    }
+    if (sc->out_pos == sc->out.len)
+        sc->since = stats_now_ms(); // the queue was empty, the send timeout starts now
+
+    if (sc->stream == STREAM_SSE) {
+        stats_buf_addstr(&sc->out, "event: ");
+        stats_buf_add(&sc->out, type, strlen(type));
+        stats_buf_addstr(&sc->out, "\ndata: ");
+        stats_buf_add(&sc->out, json, len);
+        stats_buf_addstr(&sc->out, "\n\n");
+    } else {
+        stats_buf_addstr(&sc->out, "{\"type\":\"");
+        stats_buf_add(&sc->out, type, strlen(type));
+        stats_buf_addstr(&sc->out, "\",\"data\":");
+        stats_buf_add(&sc->out, json, len);
+        stats_buf_addstr(&sc->out, "}\n");
+    }
+    return 1;
+}
+
+// Forget all delta state, e.g. when the last subscriber leaves
+static void stream_reset(void) {
+    int i;
+
+    while (dirty_channels)
+        channel_dirty_unlink(dirty_channels);
+    for (i = 0; i < num_gone_channels; i++) {
+        safe_free(gone_channels[i]);
+    }
+    num_gone_channels = 0;
+    safe_free(gone_channels);
+    gone_channels_size = 0;
+    safe_free(stream_servers);
+    num_stream_servers = 0;
+    for (i = 0; i < num_watched_changes; i++) {
+        watched_nicks[watched_changes[i]].queued = 0;
+    }
+    num_watched_changes = 0;
+}
+
+// Take the current state as the base for the first delta. Called when the
+// first subscriber arrives, as nothing is tracked without one.
+static void stream_start(void) {
+    Client *acptr;
+    Channel *channel;
+    unsigned int hashnum;
+    int n = 0;
+
+    stream_reset();
+    stream_last.clients = irccounts.clients;
+    stream_last.channels = irccounts.channels;
+    stream_last.operators = irccounts.operators;
+    stream_last.messages = counter;
+
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        if (acptr->server)
+            n++;
+    }
+    stream_last.servers = n;
+    stream_servers = safe_alloc(sizeof(struct stream_server) * (n ? n : 1));
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        if (!acptr->server || num_stream_servers == n) continue;
+        strlcpy(stream_servers[num_stream_servers].name, acptr->name, sizeof(stream_servers[0].name));
+        stream_servers[num_stream_servers++].users = acptr->server->users;
+    }
+
+    for (int i = 0; i < num_nicks; i++) {
+        watched_nicks[i].reported = watched_nicks[i].online;
+    }
+
+    for (hashnum = 0; hashnum < CHAN_HASH_TABLE_SIZE; hashnum++) {
+        for (channel = hash_get_chan_bucket(hashnum); channel; channel = channel->hnextch) {
+            channel_stats_get(channel)->was_public = PubChannel(channel) ? 1 : 0;
+        }
+    }
+}
+
+// Render what changed since the last delta into delta_buf and make the
+// current state the new base. Returns 0 if nothing changed.
+static int render_delta(void) {
+    struct json_writer writer, *w = &writer;
+    struct stream_server *servers;
+    struct channel_stats *s, *next;
+    Client *acptr;
+    int i, n = 0, changed = 0, open;
+
+    delta_buf.len = 0;
+    jw_init(w, &delta_buf);
+    jw_object_open(w);
+
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        if (acptr->server)
+            n++;
+    }
+
+#define DELTA_COUNT(field, value) \
+    if (stream_last.field != (value)) { \
+        stream_last.field = (value); \
+        jw_key_int(w, #field, stream_last.field); \
+        changed = 1; \
+    }
+    DELTA_COUNT(clients, irccounts.clients);
+    DELTA_COUNT(channels, irccounts.channels);
+    DELTA_COUNT(operators, irccounts.operators);
+    DELTA_COUNT(servers, n);
+    DELTA_COUNT(messages, counter);
+#undef DELTA_COUNT
+
+    // Servers whose user count changed or that are new, then the split ones
+    servers = safe_alloc(sizeof(struct stream_server) * (n ? n : 1));
+    n = 0;
+    open = 0;
+    list_for_each_entry(acptr, &global_server_list, client_node) {
+        struct stream_server *srv;
+        int unchanged = 0;
+
+        if (!acptr->server) continue;
+        srv = &servers[n++];
+        strlcpy(srv->name, acptr->name, sizeof(srv->name));
+        srv->users = acptr->server->users;
+        for (i = 0; i < num_stream_servers; i++) {
+            if (!strcmp(stream_servers[i].name, srv->name)) {
+                stream_servers[i].seen = 1;
+                unchanged = stream_servers[i].users == srv->users;
+                break;
+            }
+        }
+        if (unchanged) continue;
+        if (!open++) {
+            jw_key(w, "serv");
+            jw_array_open(w);
+        }
+        jw_object_open(w);
+        jw_key_str(w, "name", srv->name);
+        jw_key_int(w, "users", srv->users);
+        jw_object_close(w);
+    }
+    if (open) {
+        jw_array_close(w);
+        changed = 1;
+    }
+    open = 0;
+    for (i = 0; i < num_stream_servers; i++) {
+        if (stream_servers[i].seen) continue;
+        if (!open++) {
+            jw_key(w, "serv_gone");
+            jw_array_open(w);
+        }
+        jw_str(w, stream_servers[i].name);
+    }
+    if (open) {
+        jw_array_close(w);
+        changed = 1;
+    }
+    safe_free(stream_servers);
+    stream_servers = servers;
+    num_stream_servers = n;
+
+    // Channels: only those the hooks marked. The removals go first, so a
+    // channel destroyed and created again since the last delta ends up in
+    // the reader's state.
+    for (s = dirty_channels; s; s = next) {
+        next = s->dirty_next;
+        if (PubChannel(s->channel)) continue;
+        if (s->was_public) // went +s or +p, that is gone as far as readers are concerned
+            gone_channel_add(s->channel->name);
+        s->was_public = 0;
+        channel_dirty_unlink(s);
+    }
+    if (num_gone_channels) {
+        jw_key(w, "chan_gone");
+        jw_array_open(w);
+        for (i = 0; i < num_gone_channels; i++) {
+            jw_str(w, gone_channels[i]);
+            safe_free(gone_channels[i]);
+        }
+        num_gone_channels = 0;
+        jw_array_close(w);
+        changed = 1;
+    }
+    open = 0;
+    while ((s = dirty_channels)) {
+        Channel *channel = s->channel;
+
+        channel_dirty_unlink(s);
+        s->was_public = 1;
+        if (!open++) {
+            jw_key(w, "chan");
+            jw_array_open(w);
+        }
+        jw_object_open(w);
+        jw_key_str(w, "name", channel->name);
+        jw_key_int(w, "users", channel->users);
+        jw_key(w, "topic");
+        if (channel->topic)
+            jw_str(w, channel->topic);
+        else
+            jw_null(w);
+        jw_object_close(w);
+    }
+    if (open) {
+        jw_array_close(w);
+        changed = 1;
+    }
+
+    // Watched nicks that came online or went offline, as queued by the hooks.
+    // One that went back since the last delta is left out.
+    open = 0;
+    for (i = 0; i < num_watched_changes; i++) {
+        struct watched_nick *e = &watched_nicks[watched_changes[i]];
+
+        e->queued = 0;
+        if (e->online == e->reported) continue;
+        e->reported = e->online;
+        if (!open++) {
+            jw_key(w, "nicks_status");
+            jw_array_open(w);
+        }
+        render_watched_nick(w, e);
+    }
+    num_watched_changes = 0;
+    if (open) {
+        jw_array_close(w);
+        changed = 1;
+    }
+
+    jw_object_close(w);
+    return changed;
+}
+
+// Send what changed to every subscriber, once per stream-interval
+EVENT(socketstats_stream_evt) {
+    struct stats_client *sc, *next;
+
+    if (!stream_subscribers || !render_delta())
+        return;
+    for (sc = stats_clients; sc; sc = next) {
+        next = sc->next;
+        if (sc->stream && stream_queue_event(sc, "delta", delta_buf.data, delta_buf.len))
+            stats_client_flush(sc);
+    }
+}
+
+// Turn a request for /stream into a subscription: the full document first,
+// then a delta whenever something changed. Returns 1 if the client was freed.
+static int stats_client_subscribe(struct stats_client *sc, char *query, int sse) {
+    struct stats_buf doc = { 0 };
+    const char *content_type;
+    char target[] = "/";
+    char *param, *save = NULL;
+    int freed;
+
+    for (param = strtok_r(query, "&", &save); param; param = strtok_r(NULL, "&", &save)) {
+        if (!strcmp(param, "format=sse")) {
+            sse = 1;
+        } else if (!strcmp(param, "format=ndjson")) {
+            sse = 0;
+        } else {
+            return stats_client_error(sc, "400 Bad Request");
+        }
+    }
+    // The deltas carry on from the live state, so the snapshot has to be
+    // rendered now: a cached one may miss changes already sent as deltas
+    socketstats_render(&doc, target, &content_type);
+
+    stats_client_responding(sc);
+    if (!stream_subscribers++)
+        stream_start();
+    sc->stream = sse ? STREAM_SSE : STREAM_NDJSON;
+    sc->header_len = snprintf(sc->header, sizeof(sc->header),
+                              "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nCache-Control: no-cache\r\n\r\n",
+                              sse ? "text/event-stream" : "application/x-ndjson");
+    freed = !stream_queue_event(sc, "snapshot", doc.data, doc.len) || stats_client_flush(sc);
+    safe_free(doc.data);
+    return freed;
+}
+
+// Whether a comma-separated header value lists 'token'. Parameters are
+// ignored, except that q=0 rules it out, as in "gzip;q=0".
+static int header_has_token(const char *value, const char *token) {
+    size_t len = strlen(token);
+    const char *p = value, *end, *q;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        end = strchr(p, ',');
+        if (!strncasecmp(p, token, len) && (!p[len] || strchr(" \t,;", p[len]))) {
+            q = strstr(p + len, "q=");
+            return !q || (end && q > end) || strtod(q + 2, NULL) > 0;
+        }
+        if (!end)
+            break;
+        p = end;
+    }
+    return 0;
+}
+
+// Parse the request in the input buffer once its header is complete and
+// answer it. Returns 0 if more data is needed, -1 if the client was freed.
+static int stats_client_parse(struct stats_client *sc) {
+    char *end, *line, *next, *p;
+    char *method, *target = NULL, *version = NULL;
+    char *if_none_match = NULL;
+    int accept_sse = 0, freed;
+
+    sc->inbuf[sc->inlen] = '\0';
+    if (!(end = strstr(sc->inbuf, "\r\n\r\n")) && !(end = strstr(sc->inbuf, "\n\n")))
+        return 0;
+    // Anything after it is the next, pipelined request
+    sc->request_len = end - sc->inbuf + (*end == '\r' ? 4 : 2);
+    *end = '\0';
+
+    // Request line: method, target and version
+    method = sc->inbuf;
+    if ((next = strchr(method, '\n')))
+        *next++ = '\0';
+    if ((p = strchr(method, '\r')))
+        *p = '\0';
+    if ((p = strchr(method, ' '))) {
+        *p = '\0';
+        target = p + 1;
+        if ((p = strchr(target, ' '))) {
+            *p = '\0';
+            version = p + 1;
+        }
+    }
+    // HTTP/1.1 keeps the connection open unless asked not to, 1.0 only if asked
+    sc->http10 = version && !strcmp(version, "HTTP/1.0");
+    sc->keep_alive = version && !strcmp(version, "HTTP/1.1");
+    sc->encoding = ENCODING_IDENTITY;
+
+    for (line = next; line && *line; line = next) {
+        if ((next = strchr(line, '\n')))
+            *next++ = '\0';
+        if ((p = strchr(line, '\r')))
+            *p = '\0';
+        if (!strncasecmp(line, "If-None-Match:", 14)) {
+            for (p = line + 14; *p == ' ' || *p == '\t'; p++);
+            if_none_match = p;
+        } else if (!strncasecmp(line, "Accept:", 7) && strstr(line, "text/event-stream")) {
+            accept_sse = 1;
+        } else if (!strncasecmp(line, "Accept-Encoding:", 16)) {
+            if (header_has_token(line + 16, "gzip"))
+                sc->encoding = ENCODING_GZIP;
+            else if (header_has_token(line + 16, "deflate"))
+                sc->encoding = ENCODING_DEFLATE;
+        } else if (!strncasecmp(line, "Connection:", 11)) {
+            if (header_has_token(line + 11, "close"))
+                sc->keep_alive = 0;
+            else if (header_has_token(line + 11, "keep-alive"))
+                sc->keep_alive = 1;
+        }
+    }
+
+    if (!target || *target != '/') {
+        sc->keep_alive = 0; // cannot tell where the next request would start
+        freed = stats_client_error(sc, "400 Bad Request");
+    }
+    else if (!strcmp(method, "GET") && (!strcmp(target, "/stream") || !strncmp(target, "/stream?", 8)))
+        freed = stats_client_subscribe(sc, target[7] ? target + 8 : target + 7, accept_sse);
+    else if (!strcmp(method, "GET") || !strcmp(method, "HEAD"))
+        freed = stats_client_respond(sc, !strcmp(method, "HEAD"), target, if_none_match);
+    else
+        freed = stats_client_error(sc, "405 Method Not Allowed");
+    return freed ? -1 : 1;
+}
+
+// Answer the requests in the input buffer. A kept-alive connection is ready
+// for the next one once a response is written out, so pipelined requests are
+// taken here one after another rather than from within the flush. Returns 1
+// if the client was freed.
+static int stats_client_process(struct stats_client *sc) {
+    int ret;
+
+    while (!sc->responding) {
+        if ((ret = stats_client_parse(sc)) < 0)
+            return 1;
+        if (!ret) {
+            if (sc->inlen < sizeof(sc->inbuf) - 1)
+                return 0;
+            stats_client_free(sc); // request header too large
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void stats_client_readable(int fd, int revents, void *data) {
+    struct stats_client *sc = data;
+    ssize_t n;
+
+    n = read(fd, sc->inbuf + sc->inlen, sizeof(sc->inbuf) - 1 - sc->inlen);
+    if (n < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)
+            stats_client_free(sc);
+        return;
+    }
+    if (n == 0) {
+        // Closed its side without a request: an old style reader
+        if (sc->inlen == 0 && !sc->requests)
+            stats_client_respond(sc, 0, "/", NULL);
+        else
+            stats_client_free(sc);
+        return;
+    }
+    sc->inlen += n;
+    stats_client_process(sc);
+}
+
+static void stats_client_new(int fd) {
+    struct stats_client *sc;
+
+    if (num_stats_clients >= max_connections) {
+        unreal_log(ULOG_WARNING, "socketstats", "SOCKETSTATS_TOO_MANY_CONNECTIONS", NULL,
+                   "Refusing stats socket connection: max-connections ($max) reached",
+                   log_data_integer("max", max_connections));
+        fd_close(fd);
+        return;
+    }
+
+    sc = safe_alloc(sizeof(struct stats_client));
+    sc->fd = fd;
+    sc->since = stats_now_ms();
+
+    sc->next = stats_clients;
+    if (stats_clients)
+        stats_clients->prev = sc;
+    stats_clients = sc;
+    num_stats_clients++;
+
+    fd_setselect(fd, FD_SELECT_READ, stats_client_readable, sc);
+}
+
+// The listening socket is readable: take every pending connection
+static void socketstats_accept(int listenfd, int revents, void *data) {
+    int sock;
+
+    while ((sock = fd_accept(listenfd)) >= 0) {
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+        stats_client_new(sock);
+    }
+    if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)
+        unreal_log(ULOG_ERROR, "socketstats", "SOCKETSTATS_ACCEPT_ERROR", NULL, "Socket accept error: $error", log_data_string("error", strerror(errno)));
+}
+
+// Answer readers that sent no request within request-timeout (e.g. a plain
+// socat), and drop readers that did not take their response within the timeout
+// or kept an idle connection open for as long
+EVENT(socketstats_timeout_evt) {
+    struct stats_client *sc, *next;
+    long long now = stats_now_ms();
+
+    for (sc = stats_clients; sc; sc = next) {
+        next = sc->next;
+        if (!sc->responding && sc->requests && sc->inlen == 0) {
+            if (now - sc->since >= send_timeout * 1000)
+                stats_client_free(sc);
+        } else if (!sc->responding) {
+            if (now - sc->since >= request_timeout) {
+                if (sc->inlen == 0)
+                    stats_client_respond(sc, 0, "/", NULL);
+                else
+                    stats_client_free(sc); // a partial request that never completed
+            }
+        } else if (sc->stream && sc->pos == sc->header_len && sc->out_pos == sc->out.len) {
+            continue; // an idle subscriber, nothing pending
+        } else if (now - sc->since >= send_timeout * 1000) {
+            stats_client_free(sc);
+        }
+    }
+}
+
+#endif /* SOCKETSTATS_STANDALONE */
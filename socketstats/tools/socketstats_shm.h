@@ -0,0 +1,132 @@
+/*
+ * socketstats_shm.h - reader for the socketstats shared memory segment
+ *
+ * With shm-path set, the module keeps a small fixed-layout copy of its
+ * counters in a file, normally under /dev/shm, and updates it in place every
+ * shm-interval. Local readers map the file once and then read it without any
+ * system call and without involving the IRCd.
+ *
+ * The writer is the IRCd alone and uses a sequence lock: 'seq' is odd while
+ * an update is in progress and is incremented again when it is done. A reader
+ * copies the whole segment and retries if 'seq' was odd or changed meanwhile.
+ * socketstats_shm_read() below does exactly that.
+ *
+ * Numbers are in the host's byte order. 'version' is bumped on any change to
+ * the layout; 'size' and 'server_size' let a reader check that it was built
+ * for the same layout as the module that wrote the file.
+ *
+ * License: GPLv3 https://www.gnu.org/licenses/gpl-3.0.html
+ */
+
+#ifndef SOCKETSTATS_SHM_H
+#define SOCKETSTATS_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SOCKETSTATS_SHM_MAGIC 0x53534853 /* "SHSS" */
+#define SOCKETSTATS_SHM_VERSION 1
+#define SOCKETSTATS_SHM_SERVERS 64
+#define SOCKETSTATS_SHM_NAMELEN 64
+
+#define SOCKETSTATS_SHM_SERVER_LOCAL 0x1
+#define SOCKETSTATS_SHM_SERVER_ULINE 0x2
+
+struct socketstats_shm_server {
+    char name[SOCKETSTATS_SHM_NAMELEN];
+    uint32_t users;
+    uint32_t flags;                 /* SOCKETSTATS_SHM_SERVER_* */
+    int64_t boottime;               /* unix time */
+};
+
+struct socketstats_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                  /* sizeof(struct socketstats_shm) */
+    uint32_t server_size;           /* sizeof(struct socketstats_shm_server) */
+    uint32_t seq;                   /* odd while the module is writing */
+    uint32_t pid;                   /* of the IRCd */
+    int64_t updated_ms;             /* unix time of the last update, in ms */
+    int64_t started;                /* unix time the module was loaded */
+
+    int64_t clients;
+    int64_t channels;
+    int64_t operators;
+    int64_t servers;
+    int64_t messages;
+
+    double cpu_usage;               /* percent over the last sample-interval */
+    double cpu_usage_avg[3];        /* over 1, 5 and 15 minutes */
+    int64_t ram_total_mb;
+    int64_t ram_used_mb;
+    int64_t disk_total_mb;
+    int64_t disk_free_mb;
+    uint32_t cpu_count;
+
+    uint32_t num_servers;           /* entries used in serv[], 'servers' may be more */
+    struct socketstats_shm_server serv[SOCKETSTATS_SHM_SERVERS];
+};
+
+#define SOCKETSTATS_SHM_OK 0
+#define SOCKETSTATS_SHM_ERROR -1    /* see errno */
+#define SOCKETSTATS_SHM_LAYOUT -2   /* written by a module with another layout */
+#define SOCKETSTATS_SHM_BUSY -3     /* kept changing while being read */
+
+struct socketstats_shm_reader {
+    const struct socketstats_shm *map;
+    size_t len;
+};
+
+/* Map the segment. Returns SOCKETSTATS_SHM_OK or SOCKETSTATS_SHM_ERROR. */
+static inline int socketstats_shm_open(struct socketstats_shm_reader *r, const char *path) {
+    struct stat st;
+    void *map;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return SOCKETSTATS_SHM_ERROR;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct socketstats_shm)) {
+        close(fd);
+        return SOCKETSTATS_SHM_ERROR;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return SOCKETSTATS_SHM_ERROR;
+    r->map = map;
+    r->len = st.st_size;
+    return SOCKETSTATS_SHM_OK;
+}
+
+static inline void socketstats_shm_close(struct socketstats_shm_reader *r) {
+    if (r->map)
+        munmap((void *)r->map, r->len);
+    r->map = NULL;
+}
+
+/* Take a consistent copy of the segment into 'out'. */
+static inline int socketstats_shm_read(const struct socketstats_shm_reader *r, struct socketstats_shm *out) {
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+        uint32_t seq = __atomic_load_n(&r->map->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1)
+            continue;
+        memcpy(out, r->map, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->map->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        if (out->magic != SOCKETSTATS_SHM_MAGIC || out->version != SOCKETSTATS_SHM_VERSION ||
+            out->size != sizeof(struct socketstats_shm) || out->server_size != sizeof(struct socketstats_shm_server))
+            return SOCKETSTATS_SHM_LAYOUT;
+        return SOCKETSTATS_SHM_OK;
+    }
+    return SOCKETSTATS_SHM_BUSY;
+}
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * ss_bench - standalone serialization benchmark for socketstats
+ *
+ * Builds the socketstats output core without the IRCd (see unrealircd.h next
+ * to this file), generates a synthetic channel list with topics, and measures
+ * how long it takes to serialize the "chan" array with the streaming writer.
+ * When built with jansson (HAVE_JANSSON, see the Makefile) it also measures
+ * the old path - one json_t per channel, json_dumps() and the strlen() calls
+ * for the header and send() - and checks that both produce the same bytes.
+ *
+ * Build:  make -C socketstats/tools
+ * Usage:  ss_bench [-n channels] [-i iterations] [-t topic_percent] [-r seed]
+ *
+ * License: GPLv3 https://www.gnu.org/licenses/gpl-3.0.html
+ */
+
+#define SOCKETSTATS_STANDALONE
+#include "../socketstats.c"
+
+#ifdef HAVE_JANSSON
+#include <jansson.h>
+#endif
+
+struct bench_channel {
+    char name[CHANNELLEN + 1];
+    int users;
+    long long messages;
+    char *topic;
+};
+
+static const char *topic_words[] = {
+    "welcome", "to", "the", "\"official\"", "channel", "rules:", "no", "spam",
+    "\x02" "bold" "\x02", "\x03" "4colour", "café", "канал", "频道", "C:\\path",
+    "tab\there", "ünïcödé", "latin1\xe9", "\xff\xfe", "🙂", NULL
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct bench_channel *make_channels(int n, int topic_percent) {
+    struct bench_channel *chans = safe_alloc(sizeof(struct bench_channel) * n);
+    int nwords = 0, i, j;
+
+    while (topic_words[nwords])
+        nwords++;
+
+    for (i = 0; i < n; i++) {
+        struct bench_channel *c = &chans[i];
+
+        switch (rand() % 8) {
+            case 0:  snprintf(c->name, sizeof(c->name), "#café-%d", i); break;
+            case 1:  snprintf(c->name, sizeof(c->name), "#канал%d", i); break;
+            default: snprintf(c->name, sizeof(c->name), "#channel%d", i); break;
+        }
+        c->users = 1 + rand() % 500;
+        c->messages = rand() % 1000000;
+        if (rand() % 100 < topic_percent) {
+            char topic[MAXTOPICLEN + 1] = "";
+            int words = 3 + rand() % 20;
+
+            for (j = 0; j < words; j++) {
+                if (j)
+                    strncat(topic, " ", sizeof(topic) - strlen(topic) - 1);
+                strncat(topic, topic_words[rand() % nwords], sizeof(topic) - strlen(topic) - 1);
+            }
+            c->topic = strdup(topic);
+        }
+    }
+    return chans;
+}
+
+static void render_writer(struct stats_buf *buf, const struct bench_channel *chans, int n) {
+    struct json_writer w;
+    int i;
+
+    buf->len = 0;
+    jw_init(&w, buf);
+    jw_array_open(&w);
+    for (i = 0; i < n; i++) {
+        stats_json_channel(&w, CHANNEL_FIELDS_ALL, chans[i].name, chans[i].users, chans[i].messages, chans[i].topic);
+    }
+    jw_array_close(&w);
+}
+
+#ifdef HAVE_JANSSON
+// json_string_unreal(): replace invalid UTF-8 the same way the writer does
+static json_t *bench_json_string_unreal(const char *str) {
+    char buf[4 * MAXTOPICLEN + 1];
+    const unsigned char *s = (const unsigned char *)str;
+    size_t left = strlen(str), o = 0;
+
+    while (left && o < sizeof(buf) - 5) {
+        int len = *s < 0x80 ? 1 : json_utf8_len(s, left);
+
+        if (len) {
+            memcpy(buf + o, s, len);
+            o += len;
+            s += len;
+            left -= len;
+        } else {
+            buf[o++] = '?';
+            s++;
+            left--;
+        }
+    }
+    buf[o] = '\0';
+    return json_string(buf);
+}
+
+static char *render_jansson(const struct bench_channel *chans, int n, size_t *len) {
+    json_t *channels = json_array();
+    char header[512];
+    char *result;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        json_t *channel_j = json_object();
+        json_object_set_new(channel_j, "name", bench_json_string_unreal(chans[i].name));
+        json_object_set_new(channel_j, "users", json_integer(chans[i].users));
+        json_object_set_new(channel_j, "messages", json_integer(chans[i].messages));
+        if (chans[i].topic)
+            json_object_set_new(channel_j, "topic", bench_json_string_unreal(chans[i].topic));
+        json_array_append_new(channels, channel_j);
+    }
+    result = json_dumps(channels, JSON_COMPACT);
+    json_decref(channels);
+
+    // The old code measured the body once for the header and once for send()
+    snprintf(header, sizeof(header), "Content-Length: %zu", strlen(result));
+    *len = strlen(result);
+    return result;
+}
+#endif
+
+int main(int argc, char **argv) {
+    int n = 20000, iterations = 20, topic_percent = 50;
+    unsigned int seed = 1;
+    struct bench_channel *chans;
+    struct stats_buf buf = { 0 };
+    double t, writer_time;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "n:i:t:r:")) != -1) {
+        switch (opt) {
+            case 'n': n = atoi(optarg); break;
+            case 'i': iterations = atoi(optarg); break;
+            case 't': topic_percent = atoi(optarg); break;
+            case 'r': seed = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n channels] [-i iterations] [-t topic_percent] [-r seed]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (n < 1 || iterations < 1) {
+        fprintf(stderr, "-n and -i must be positive\n");
+        return 1;
+    }
+    srand(seed);
+    chans = make_channels(n, topic_percent);
+
+    printf("%d channels, %d%% with a topic, %d iterations\n", n, topic_percent, iterations);
+
+    render_writer(&buf, chans, n); // warm up, sizes the buffer once
+    t = now_sec();
+    for (i = 0; i < iterations; i++) {
+        render_writer(&buf, chans, n);
+    }
+    writer_time = (now_sec() - t) / iterations;
+    printf("  writer:  %8.3f ms per render, %6.1f ns per channel, %zu bytes\n",
+           writer_time * 1e3, writer_time * 1e9 / n, buf.len);
+
+#ifdef HAVE_JANSSON
+    {
+        double jansson_time;
+        size_t len;
+        char *result = render_jansson(chans, n, &len);
+
+        if (len != buf.len || memcmp(result, buf.data, len)) {
+            printf("  MISMATCH between the writer and jansson output\n");
+            free(result);
+            return 1;
+        }
+        free(result);
+
+        t = now_sec();
+        for (i = 0; i < iterations; i++) {
+            result = render_jansson(chans, n, &len);
+            free(result);
+        }
+        jansson_time = (now_sec() - t) / iterations;
+        printf("  jansson: %8.3f ms per render, %6.1f ns per channel, %zu bytes (%.1fx slower)\n",
+               jansson_time * 1e3, jansson_time * 1e9 / n, len, jansson_time / writer_time);
+    }
+#else
+    printf("  jansson: not built, install jansson and rebuild to compare\n");
+#endif
+
+    for (i = 0; i < n; i++) {
+        free(chans[i].topic);
+    }
+    free(chans);
+    safe_free(buf.data);
+    return 0;
+}
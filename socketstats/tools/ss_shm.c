@@ -0,0 +1,101 @@
+/*
+ * ss_shm - print the socketstats shared memory segment
+ *
+ * Reads the segment the module writes when shm-path is set (see
+ * socketstats_shm.h) and prints it as "key value" lines, once or every
+ * interval. Reading costs no system call and does not involve the IRCd.
+ *
+ * Build:  make -C socketstats/tools
+ * Usage:  ss_shm [-f path] [-i interval_ms] [-m max_age_ms]
+ *
+ * With -m, exits with 2 if the segment was not updated within max_age_ms,
+ * e.g. for a health check.
+ *
+ * License: GPLv3 https://www.gnu.org/licenses/gpl-3.0.html
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "socketstats_shm.h"
+
+static long long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void print_stats(const struct socketstats_shm *s) {
+    uint32_t i;
+
+    printf("pid %u\n", s->pid);
+    printf("age_ms %lld\n", now_ms() - (long long)s->updated_ms);
+    printf("clients %lld\n", (long long)s->clients);
+    printf("channels %lld\n", (long long)s->channels);
+    printf("operators %lld\n", (long long)s->operators);
+    printf("servers %lld\n", (long long)s->servers);
+    printf("messages %lld\n", (long long)s->messages);
+    printf("cpu_cores %u\n", s->cpu_count);
+    printf("cpu_usage_percent %.1f\n", s->cpu_usage);
+    printf("cpu_usage_percent_avg %.1f %.1f %.1f\n", s->cpu_usage_avg[0], s->cpu_usage_avg[1], s->cpu_usage_avg[2]);
+    printf("ram_total_mb %lld\n", (long long)s->ram_total_mb);
+    printf("ram_used_mb %lld\n", (long long)s->ram_used_mb);
+    printf("disk_total_mb %lld\n", (long long)s->disk_total_mb);
+    printf("disk_free_mb %lld\n", (long long)s->disk_free_mb);
+    for (i = 0; i < s->num_servers && i < SOCKETSTATS_SHM_SERVERS; i++) {
+        const struct socketstats_shm_server *srv = &s->serv[i];
+
+        printf("server %.*s users %u uptime %lld%s%s\n", SOCKETSTATS_SHM_NAMELEN, srv->name, srv->users,
+               (long long)(time(NULL) - srv->boottime),
+               srv->flags & SOCKETSTATS_SHM_SERVER_LOCAL ? " local" : "",
+               srv->flags & SOCKETSTATS_SHM_SERVER_ULINE ? " uline" : "");
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *path = "/dev/shm/socketstats";
+    struct socketstats_shm_reader reader = { 0 };
+    struct socketstats_shm stats;
+    long interval = 0, max_age = 0;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "f:i:m:")) != -1) {
+        switch (opt) {
+            case 'f': path = optarg; break;
+            case 'i': interval = atol(optarg); break;
+            case 'm': max_age = atol(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-f path] [-i interval_ms] [-m max_age_ms]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (socketstats_shm_open(&reader, path) != SOCKETSTATS_SHM_OK) {
+        fprintf(stderr, "%s: %s\n", path, errno ? strerror(errno) : "too small");
+        return 1;
+    }
+    for (;;) {
+        ret = socketstats_shm_read(&reader, &stats);
+        if (ret == SOCKETSTATS_SHM_LAYOUT) {
+            fprintf(stderr, "%s: written with another layout (version %u), rebuild ss_shm\n", path, stats.version);
+            return 1;
+        } else if (ret == SOCKETSTATS_SHM_BUSY) {
+            fprintf(stderr, "%s: kept changing while being read\n", path);
+            return 1;
+        }
+        if (max_age && now_ms() - stats.updated_ms > max_age) {
+            fprintf(stderr, "%s: not updated for %lld ms\n", path, now_ms() - (long long)stats.updated_ms);
+            return 2;
+        }
+        print_stats(&stats);
+        if (!interval)
+            break;
+        printf("\n");
+        fflush(stdout);
+        usleep(interval * 1000);
+    }
+    socketstats_shm_close(&reader);
+    return 0;
+}
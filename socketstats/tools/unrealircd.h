@@ -0,0 +1,46 @@
+/*
+ * Minimal stand-in for the UnrealIRCd headers, providing just the symbols the
+ * socketstats output core uses so it can be built outside the IRCd with
+ * SOCKETSTATS_STANDALONE (see ss_bench.c). Not used for the module itself.
+ *
+ * License: GPLv3 https://www.gnu.org/licenses/gpl-3.0.html
+ */
+
+#ifndef SOCKETSTATS_STUB_UNREALIRCD_H
+#define SOCKETSTATS_STUB_UNREALIRCD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define MAXTOPICLEN 360
+#define CHANNELLEN 32
+
+#define UNREAL_VERSION_GENERATION 6
+#define UNREAL_VERSION_MAJOR 0
+#define UNREAL_VERSION_MINOR 0
+
+typedef int SendType;
+
+static inline void *safe_alloc(size_t size) {
+    void *p = calloc(1, size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+#define safe_free(x) do { free(x); (x) = NULL; } while (0)
+
+#endif